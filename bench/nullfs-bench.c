@@ -0,0 +1,1089 @@
+/*
+ *   nullfsvfs benchmark helper.
+ *
+ *   Copyright (C) 2018  Michael Ablassmeier <abi@grinser.de>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *
+ *
+ * Drive a mounted nullfsvfs (or any other file system, for comparison)
+ * with different I/O patterns and print the achieved rate. With -j every
+ * result is printed as one JSON object per line, see run.sh.
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../nullfsvfs_image.h"
+
+/* io_uring is driven through the raw system calls, no liburing needed */
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#define NULLFS_MAGIC 0x19980123
+#define TMPFS_MAGIC 0x01021994
+
+struct bench_opts {
+  const char *dir;
+  size_t bs;
+  size_t total;
+  int iovcnt;
+  int threads;
+  int depth;
+  long files;
+};
+
+static int json;
+static char fsname[32];
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *what) {
+  perror(what);
+  exit(1);
+}
+
+static int open_file(const struct bench_opts *o, const char *name, int flags) {
+  char path[4096];
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/%s", o->dir, name);
+  fd = open(path, flags, 0644);
+  if (fd < 0)
+    die(path);
+  return fd;
+}
+
+static void set_fsname(const char *dir) {
+  struct statfs st;
+
+  if (statfs(dir, &st))
+    die(dir);
+  if (st.f_type == NULLFS_MAGIC)
+    strcpy(fsname, "nullfsvfs");
+  else if (st.f_type == TMPFS_MAGIC)
+    strcpy(fsname, "tmpfs");
+  else
+    snprintf(fsname, sizeof(fsname), "0x%lx", (unsigned long)st.f_type);
+}
+
+static void report_json(const char *test, const char *unit, size_t n,
+                        double secs, double rate) {
+  printf("{\"fs\":\"%s\",\"test\":\"%s\",\"%s\":%zu,\"secs\":%.6f,"
+         "\"rate\":%.2f,\"unit\":\"%s\"}\n",
+         fsname, test, strcmp(unit, "MiB/s") ? "ops" : "bytes", n, secs, rate,
+         unit);
+}
+
+static void report(const char *test, size_t bytes, double secs) {
+  double rate = bytes / secs / (1024 * 1024);
+
+  if (json)
+    report_json(test, "MiB/s", bytes, secs, rate);
+  else
+    printf("%-10s %12zu bytes %8.3f s %10.2f MiB/s\n", test, bytes, secs,
+           rate);
+}
+
+static void report_ops(const char *test, size_t ops, double secs) {
+  if (json)
+    report_json(test, "ops/s", ops, secs, ops / secs);
+  else
+    printf("%-10s %12zu ops   %8.3f s %10.0f ops/s\n", test, ops, secs,
+           ops / secs);
+}
+
+/* single operations, only the time matters */
+static void report_time(const char *test, const char *what, double secs) {
+  if (json)
+    printf("{\"fs\":\"%s\",\"test\":\"%s\",\"secs\":%.6f,\"unit\":\"s\"}\n",
+           fsname, test, secs);
+  else
+    printf("%-10s %12s       %8.6f s\n", test, what, secs);
+}
+
+static unsigned long long next_rand(unsigned long long *x) {
+  *x ^= *x << 13;
+  *x ^= *x >> 7;
+  *x ^= *x << 17;
+  return *x;
+}
+
+static int bench_write(const struct bench_opts *o) {
+  char *buf = calloc(1, o->bs);
+  size_t done = 0;
+  double start;
+  int fd;
+
+  if (!buf)
+    die("calloc");
+  fd = open_file(o, "bench.write", O_WRONLY | O_CREAT | O_TRUNC);
+  start = now();
+  while (done < o->total) {
+    ssize_t ret = write(fd, buf, o->bs);
+    if (ret < 0)
+      die("write");
+    done += ret;
+  }
+  report("write", done, now() - start);
+  close(fd);
+  free(buf);
+  return 0;
+}
+
+static int bench_writev(const struct bench_opts *o) {
+  struct iovec *iov = calloc(o->iovcnt, sizeof(*iov));
+  size_t seg = o->bs / o->iovcnt;
+  char *buf = calloc(1, o->bs);
+  size_t done = 0;
+  double start;
+  int fd, i;
+
+  if (!iov || !buf)
+    die("calloc");
+  for (i = 0; i < o->iovcnt; i++) {
+    iov[i].iov_base = buf + i * seg;
+    iov[i].iov_len = seg;
+  }
+  fd = open_file(o, "bench.writev", O_WRONLY | O_CREAT | O_TRUNC);
+  start = now();
+  while (done < o->total) {
+    ssize_t ret = writev(fd, iov, o->iovcnt);
+    if (ret < 0)
+      die("writev");
+    done += ret;
+  }
+  report("writev", done, now() - start);
+  close(fd);
+  free(iov);
+  free(buf);
+  return 0;
+}
+
+static int bench_read(const struct bench_opts *o) {
+  char *buf = malloc(o->bs);
+  size_t done = 0;
+  double start;
+  int fd;
+
+  if (!buf)
+    die("malloc");
+  fd = open_file(o, "bench.read", O_RDWR | O_CREAT | O_TRUNC);
+  if (ftruncate(fd, o->total))
+    die("ftruncate");
+  start = now();
+  for (;;) {
+    ssize_t ret = read(fd, buf, o->bs);
+    if (ret < 0)
+      die("read");
+    if (ret == 0)
+      break;
+    done += ret;
+  }
+  report("read", done, now() - start);
+  close(fd);
+  free(buf);
+  return 0;
+}
+
+static int bench_preadv(const struct bench_opts *o) {
+  struct iovec *iov = calloc(o->iovcnt, sizeof(*iov));
+  size_t seg = o->bs / o->iovcnt;
+  char *buf = malloc(o->bs);
+  size_t done = 0;
+  double start;
+  int fd, i;
+
+  if (!iov || !buf)
+    die("calloc");
+  for (i = 0; i < o->iovcnt; i++) {
+    iov[i].iov_base = buf + i * seg;
+    iov[i].iov_len = seg;
+  }
+  fd = open_file(o, "bench.preadv", O_RDWR | O_CREAT | O_TRUNC);
+  if (ftruncate(fd, o->total))
+    die("ftruncate");
+  start = now();
+  for (;;) {
+    ssize_t ret = preadv(fd, iov, o->iovcnt, done);
+    if (ret < 0)
+      die("preadv");
+    if (ret == 0)
+      break;
+    done += ret;
+  }
+  report("preadv", done, now() - start);
+  close(fd);
+  free(iov);
+  free(buf);
+  return 0;
+}
+
+/* random block sized pwrite/pread with O_DIRECT, like a database would */
+static int bench_dio(const struct bench_opts *o) {
+  size_t blocks = o->total / o->bs, done = 0, i;
+  unsigned long long x = 88172645463325252ULL;
+  double start;
+  void *buf;
+  int fd, ret = 0;
+
+  if (!blocks)
+    return 0;
+  if (posix_memalign(&buf, 4096, o->bs))
+    die("posix_memalign");
+  memset(buf, 0, o->bs);
+  fd = open_file(o, "bench.dio", O_RDWR | O_CREAT | O_TRUNC | O_DIRECT);
+  if (ftruncate(fd, blocks * o->bs))
+    die("ftruncate");
+
+  start = now();
+  for (i = 0; i < blocks; i++, done++) {
+    if (pwrite(fd, buf, o->bs, next_rand(&x) % blocks * o->bs) !=
+        (ssize_t)o->bs)
+      die("pwrite");
+  }
+  report_ops("dio-write", done, now() - start);
+
+  start = now();
+  for (i = 0, done = 0; i < blocks; i++, done++) {
+    if (pread(fd, buf, o->bs, next_rand(&x) % blocks * o->bs) !=
+        (ssize_t)o->bs)
+      die("pread");
+  }
+  report_ops("dio-read", done, now() - start);
+
+  /* misaligned requests are refused like on a real disk */
+  if (pwrite(fd, (char *)buf + 1, o->bs - 1, 0) >= 0 || errno != EINVAL) {
+    fprintf(stderr, "dio: misaligned write did not fail with EINVAL\n");
+    ret = 1;
+  }
+  close(fd);
+  free(buf);
+  return ret;
+}
+
+/* block sized pwrite/pread at random offsets through the page cache */
+static int bench_random(const struct bench_opts *o, const char *test,
+                        int write) {
+  size_t blocks = o->total / o->bs, done = 0, i;
+  unsigned long long x = 88172645463325252ULL;
+  double start;
+  char *buf;
+  int fd;
+
+  if (!blocks)
+    return 0;
+  buf = calloc(1, o->bs);
+  if (!buf)
+    die("calloc");
+  fd = open_file(o, "bench.random", O_RDWR | O_CREAT | O_TRUNC);
+  if (ftruncate(fd, blocks * o->bs))
+    die("ftruncate");
+  start = now();
+  for (i = 0; i < blocks; i++) {
+    off_t off = next_rand(&x) % blocks * o->bs;
+    ssize_t ret = write ? pwrite(fd, buf, o->bs, off)
+                        : pread(fd, buf, o->bs, off);
+    if (ret != (ssize_t)o->bs)
+      die(test);
+    done += ret;
+  }
+  report(test, done, now() - start);
+  close(fd);
+  free(buf);
+  return 0;
+}
+
+static int bench_randwrite(const struct bench_opts *o) {
+  return bench_random(o, "randwrite", 1);
+}
+
+static int bench_randread(const struct bench_opts *o) {
+  return bench_random(o, "randread", 0);
+}
+
+#ifdef HAVE_IO_URING
+struct uring {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+};
+
+static int uring_init(struct uring *r, unsigned entries) {
+  struct io_uring_params p;
+  char *sq, *cq;
+
+  memset(&p, 0, sizeof(p));
+  r->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (r->fd < 0)
+    return -1;
+  sq = mmap(NULL, p.sq_off.array + p.sq_entries * sizeof(unsigned),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+            IORING_OFF_SQ_RING);
+  cq = mmap(NULL, p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+            IORING_OFF_CQ_RING);
+  r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                 IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || r->sqes == MAP_FAILED)
+    die("mmap io_uring");
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 0;
+}
+
+static void uring_queue(struct uring *r, int op, int fd, struct iovec *iov,
+                        off_t off) {
+  unsigned tail = *r->sq_tail, idx = tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[idx];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)iov;
+  sqe->len = 1;
+  sqe->off = off;
+  r->sq_array[idx] = idx;
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* collect all finished requests, returns how many there were */
+static unsigned uring_reap(struct uring *r, size_t *done) {
+  unsigned head = *r->cq_head, n = 0;
+
+  while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+
+    if (cqe->res < 0) {
+      errno = -cqe->res;
+      die("io_uring");
+    }
+    *done += cqe->res;
+    head++;
+    n++;
+  }
+  __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+/* keep depth requests in flight, each one block sized */
+static int bench_uring(const struct bench_opts *o, const char *test, int op,
+                       int shuffle) {
+  size_t blocks = o->total / o->bs, queued = 0, done = 0;
+  unsigned long long x = 88172645463325252ULL;
+  unsigned inflight = 0, submit = 0;
+  struct iovec iov;
+  struct uring r;
+  double start;
+  int fd;
+
+  if (!blocks)
+    return 0;
+  if (uring_init(&r, o->depth)) {
+    fprintf(stderr, "%s: io_uring not available: %s, skipped\n", test,
+            strerror(errno));
+    return 0;
+  }
+  iov.iov_len = o->bs;
+  iov.iov_base = calloc(1, o->bs);
+  if (!iov.iov_base)
+    die("calloc");
+  fd = open_file(o, "bench.uring", O_RDWR | O_CREAT | O_TRUNC);
+  if (ftruncate(fd, blocks * o->bs))
+    die("ftruncate");
+
+  start = now();
+  while (queued < blocks || inflight) {
+    while (queued < blocks && inflight + submit < (unsigned)o->depth) {
+      off_t off = shuffle ? next_rand(&x) % blocks : queued;
+
+      uring_queue(&r, op, fd, &iov, off * o->bs);
+      queued++;
+      submit++;
+    }
+    if (syscall(__NR_io_uring_enter, r.fd, submit, 1, IORING_ENTER_GETEVENTS,
+                NULL, 0) < 0)
+      die("io_uring_enter");
+    inflight += submit;
+    submit = 0;
+    inflight -= uring_reap(&r, &done);
+  }
+  report(test, done, now() - start);
+  close(fd);
+  close(r.fd);
+  free(iov.iov_base);
+  return 0;
+}
+
+static int bench_uring_write(const struct bench_opts *o) {
+  return bench_uring(o, "uring-write", IORING_OP_WRITEV, 0);
+}
+
+static int bench_uring_randread(const struct bench_opts *o) {
+  return bench_uring(o, "uring-randread", IORING_OP_READV, 1);
+}
+#endif
+
+static int bench_sendfile(const struct bench_opts *o) {
+  size_t done = 0;
+  double start;
+  int in, out;
+
+  in = open_file(o, "bench.sendfile.in", O_RDWR | O_CREAT | O_TRUNC);
+  out = open_file(o, "bench.sendfile.out", O_WRONLY | O_CREAT | O_TRUNC);
+  if (ftruncate(in, o->total))
+    die("ftruncate");
+  start = now();
+  while (done < o->total) {
+    ssize_t ret = sendfile(out, in, NULL, o->bs);
+    if (ret < 0)
+      die("sendfile");
+    if (ret == 0)
+      break;
+    done += ret;
+  }
+  report("sendfile", done, now() - start);
+  close(in);
+  close(out);
+  return 0;
+}
+
+static int bench_splice(const struct bench_opts *o) {
+  size_t done = 0;
+  double start;
+  int in, out;
+  int p[2];
+
+  if (pipe(p))
+    die("pipe");
+  fcntl(p[1], F_SETPIPE_SZ, o->bs);
+  in = open_file(o, "bench.splice.in", O_RDWR | O_CREAT | O_TRUNC);
+  out = open_file(o, "bench.splice.out", O_WRONLY | O_CREAT | O_TRUNC);
+  if (ftruncate(in, o->total))
+    die("ftruncate");
+  start = now();
+  while (done < o->total) {
+    ssize_t ret = splice(in, NULL, p[1], NULL, o->bs, SPLICE_F_MOVE);
+    if (ret < 0)
+      die("splice in");
+    if (ret == 0)
+      break;
+    while (ret > 0) {
+      ssize_t n = splice(p[0], NULL, out, NULL, ret, SPLICE_F_MOVE);
+      if (n <= 0)
+        die("splice out");
+      ret -= n;
+      done += n;
+    }
+  }
+  report("splice", done, now() - start);
+  close(in);
+  close(out);
+  close(p[0]);
+  close(p[1]);
+  return 0;
+}
+
+static int bench_mmap(const struct bench_opts *o) {
+  double start, mapped, synced;
+  size_t off;
+  char *map;
+  int fd;
+
+  fd = open_file(o, "bench.mmap", O_RDWR | O_CREAT | O_TRUNC);
+  if (ftruncate(fd, o->total))
+    die("ftruncate");
+  start = now();
+  map = mmap(NULL, o->total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    die("mmap");
+  for (off = 0; off < o->total; off += 4096)
+    map[off] = 1;
+  mapped = now();
+  if (msync(map, o->total, MS_SYNC))
+    die("msync");
+  synced = now();
+  if (munmap(map, o->total))
+    die("munmap");
+  report("mmap", o->total, mapped - start);
+  report_time("msync", "-", synced - mapped);
+  report_time("munmap", "-", now() - synced);
+  close(fd);
+  return 0;
+}
+
+struct mt_arg {
+  const struct bench_opts *o;
+  pthread_t tid;
+  int fd;
+  int idx;
+  size_t done;
+};
+
+static void *pwrite_worker(void *data) {
+  struct mt_arg *a = data;
+  const struct bench_opts *o = a->o;
+  size_t nblocks = o->total / o->bs;
+  char *buf = calloc(1, o->bs);
+  size_t blk;
+
+  if (!buf)
+    die("calloc");
+  /* interleave the blocks of all threads, and keep overwriting block 0 */
+  for (blk = a->idx; blk < nblocks; blk += o->threads) {
+    if (pwrite(a->fd, buf, o->bs, blk * o->bs) != (ssize_t)o->bs)
+      die("pwrite");
+    if (pwrite(a->fd, buf, o->bs, 0) != (ssize_t)o->bs)
+      die("pwrite");
+    a->done += 2 * o->bs;
+  }
+  free(buf);
+  return NULL;
+}
+
+static void *append_worker(void *data) {
+  struct mt_arg *a = data;
+  const struct bench_opts *o = a->o;
+  size_t share = o->total / o->threads / o->bs * o->bs;
+  char *buf = calloc(1, o->bs);
+
+  if (!buf)
+    die("calloc");
+  while (a->done < share) {
+    if (write(a->fd, buf, o->bs) != (ssize_t)o->bs)
+      die("write");
+    a->done += o->bs;
+  }
+  free(buf);
+  return NULL;
+}
+
+static size_t run_threads(const struct bench_opts *o, int fd,
+                          void *(*fn)(void *), double *secs) {
+  struct mt_arg *args = calloc(o->threads, sizeof(*args));
+  size_t done = 0;
+  double start;
+  int i;
+
+  if (!args)
+    die("calloc");
+  start = now();
+  for (i = 0; i < o->threads; i++) {
+    args[i].o = o;
+    args[i].fd = fd;
+    args[i].idx = i;
+    if (pthread_create(&args[i].tid, NULL, fn, &args[i]))
+      die("pthread_create");
+  }
+  for (i = 0; i < o->threads; i++) {
+    pthread_join(args[i].tid, NULL);
+    done += args[i].done;
+  }
+  *secs = now() - start;
+  free(args);
+  return done;
+}
+
+static int check_size(const char *test, int fd, off_t expect) {
+  struct stat st;
+
+  if (fstat(fd, &st))
+    die("fstat");
+  if (st.st_size != expect) {
+    fprintf(stderr, "%s: size mismatch: expected %lld, got %lld\n", test,
+            (long long)expect, (long long)st.st_size);
+    return 1;
+  }
+  return 0;
+}
+
+static int bench_pwrite_mt(const struct bench_opts *o) {
+  off_t expect = o->total / o->bs * o->bs;
+  char buf[64];
+  double secs;
+  size_t done;
+  int fd, ret;
+
+  fd = open_file(o, "bench.pwrite-mt", O_RDWR | O_CREAT | O_TRUNC);
+  done = run_threads(o, fd, pwrite_worker, &secs);
+  report("pwrite-mt", done, secs);
+  ret = check_size("pwrite-mt", fd, expect);
+
+  /* reads stop at EOF, and honour the offset */
+  if (pread(fd, buf, sizeof(buf), expect - 10) != 10 ||
+      pread(fd, buf, sizeof(buf), expect) != 0 ||
+      lseek(fd, expect - 1, SEEK_SET) != expect - 1 ||
+      read(fd, buf, sizeof(buf)) != 1) {
+    fprintf(stderr, "pwrite-mt: read at EOF returned wrong length\n");
+    ret = 1;
+  }
+  close(fd);
+  return ret;
+}
+
+static int bench_append_mt(const struct bench_opts *o) {
+  off_t expect = o->total / o->threads / o->bs * o->bs * o->threads;
+  double secs;
+  size_t done;
+  int fd, ret;
+
+  fd = open_file(o, "bench.append-mt", O_WRONLY | O_CREAT | O_TRUNC | O_APPEND);
+  done = run_threads(o, fd, append_worker, &secs);
+  report("append-mt", done, secs);
+  ret = check_size("append-mt", fd, expect);
+  close(fd);
+  return ret;
+}
+
+static void entry_path(const struct bench_opts *o, long i, char *path,
+                       size_t len) {
+  snprintf(path, len, "%s/bench.dir/f%08ld", o->dir, i);
+}
+
+static void *create_worker(void *data) {
+  struct mt_arg *a = data;
+  char path[4096];
+  long i;
+
+  for (i = a->idx; i < a->o->files; i += a->o->threads) {
+    int fd;
+
+    entry_path(a->o, i, path, sizeof(path));
+    fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+      die(path);
+    close(fd);
+    a->done++;
+  }
+  return NULL;
+}
+
+static void *stat_worker(void *data) {
+  struct mt_arg *a = data;
+  char path[4096];
+  struct stat st;
+  long i;
+
+  for (i = a->idx; i < a->o->files; i += a->o->threads) {
+    entry_path(a->o, i, path, sizeof(path));
+    if (stat(path, &st))
+      die(path);
+    a->done++;
+  }
+  return NULL;
+}
+
+/* move every entry away and back again, two renames per file */
+static void *rename_worker(void *data) {
+  struct mt_arg *a = data;
+  char path[4096], tmp[4100];
+  long i;
+
+  for (i = a->idx; i < a->o->files; i += a->o->threads) {
+    entry_path(a->o, i, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.r", path);
+    if (rename(path, tmp) || rename(tmp, path))
+      die(path);
+    a->done += 2;
+  }
+  return NULL;
+}
+
+static void *unlink_worker(void *data) {
+  struct mt_arg *a = data;
+  char path[4096];
+  long i;
+
+  for (i = a->idx; i < a->o->files; i += a->o->threads) {
+    entry_path(a->o, i, path, sizeof(path));
+    if (unlink(path))
+      die(path);
+    a->done++;
+  }
+  return NULL;
+}
+
+static int bench_create(const struct bench_opts *o) {
+  char path[4096];
+  double secs;
+  size_t done;
+
+  snprintf(path, sizeof(path), "%s/bench.dir", o->dir);
+  if (mkdir(path, 0755) && errno != EEXIST)
+    die(path);
+  done = run_threads(o, -1, create_worker, &secs);
+  report_ops("create", done, secs);
+  return 0;
+}
+
+static int bench_stat(const struct bench_opts *o) {
+  double secs;
+  size_t done;
+
+  done = run_threads(o, -1, stat_worker, &secs);
+  report_ops("stat", done, secs);
+  return 0;
+}
+
+static int bench_rename(const struct bench_opts *o) {
+  double secs;
+  size_t done;
+
+  done = run_threads(o, -1, rename_worker, &secs);
+  report_ops("rename", done, secs);
+  return 0;
+}
+
+static int bench_unlink(const struct bench_opts *o) {
+  double secs;
+  size_t done;
+
+  done = run_threads(o, -1, unlink_worker, &secs);
+  report_ops("unlink", done, secs);
+  return 0;
+}
+
+static int bench_readdir(const struct bench_opts *o) {
+  char path[4096];
+  struct dirent *de;
+  size_t done = 0;
+  long half = 0;
+  double start;
+  DIR *dir;
+
+  snprintf(path, sizeof(path), "%s/bench.dir", o->dir);
+  dir = opendir(path);
+  if (!dir)
+    die(path);
+  start = now();
+  while ((de = readdir(dir))) {
+    if (++done == o->files / 2)
+      half = telldir(dir);
+  }
+  report_ops("readdir", done, now() - start);
+
+  /* continuing in the middle of a huge directory should be cheap */
+  start = now();
+  seekdir(dir, half);
+  de = readdir(dir);
+  report_time("seekdir", de ? de->d_name : "-", now() - start);
+  closedir(dir);
+  return 0;
+}
+
+/**
+ * batch: the files of the create test, but created with NULLFS_IOC_BATCH
+ * in a directory of their own, BATCH_ENTRIES per call. Only the ioctls
+ * are timed, the files are removed again afterwards.
+ **/
+#define BATCH_ENTRIES 65536
+
+static int bench_batch(const struct bench_opts *o) {
+  struct nullfs_image_entry e = {0};
+  struct nullfs_batch b = {0};
+  char path[4096], name[32];
+  long i, j, n, done = 0;
+  int32_t *errors;
+  double secs = 0;
+  char *buf, *p;
+  int fd, ret = 0;
+  long r;
+
+  snprintf(path, sizeof(path), "%s/bench.dir.batch", o->dir);
+  if (mkdir(path, 0755) && errno != EEXIST)
+    die(path);
+  fd = open(path, O_RDONLY | O_DIRECTORY);
+  if (fd < 0)
+    die(path);
+  buf = malloc(BATCH_ENTRIES * (sizeof(e) + sizeof(name)));
+  errors = malloc(BATCH_ENTRIES * sizeof(*errors));
+  if (!buf || !errors)
+    die("malloc");
+
+  e.mode = htole32(S_IFREG | 0644);
+  for (i = 0; i < o->files; i += n) {
+    n = o->files - i < BATCH_ENTRIES ? o->files - i : BATCH_ENTRIES;
+    for (p = buf, j = 0; j < n; j++) {
+      e.namelen = htole16(snprintf(name, sizeof(name), "f%08ld", i + j));
+      memcpy(p, &e, sizeof(e));
+      memcpy(p + sizeof(e), name, le16toh(e.namelen));
+      p += sizeof(e) + le16toh(e.namelen);
+    }
+    b.buf = (uintptr_t)buf;
+    b.len = p - buf;
+    b.errors = (uintptr_t)errors;
+    /* entries after the one a short batch stopped at keep this */
+    for (j = 0; j < n; j++)
+      errors[j] = 1;
+    secs -= now();
+    r = ioctl(fd, NULLFS_IOC_BATCH, &b);
+    secs += now();
+    if (r < 0 && errno == ENOTTY) {
+      fprintf(stderr, "batch: not supported on %s\n", fsname);
+      goto out;
+    }
+    if (r < 0)
+      die("NULLFS_IOC_BATCH");
+    done += r;
+    if (r != n) {
+      for (j = 0; j < n && !errors[j]; j++)
+        ;
+      fprintf(stderr, "batch: f%08ld: %s\n", i + j,
+              strerror(j < n && errors[j] < 0 ? -errors[j] : EIO));
+      ret = 1;
+      break;
+    }
+  }
+  report_ops("batch", done, secs);
+
+out:
+  for (i = 0; i < o->files; i++) {
+    snprintf(name, sizeof(name), "f%08ld", i);
+    if (unlinkat(fd, name, 0) && errno != ENOENT)
+      die(name);
+  }
+  close(fd);
+  if (rmdir(path))
+    die(path);
+  free(errors);
+  free(buf);
+  return ret;
+}
+
+/* Slab: from /proc/meminfo, in bytes */
+static long long slab_bytes(void) {
+  char line[256];
+  long long kb = -1;
+  FILE *f = fopen("/proc/meminfo", "r");
+
+  if (!f)
+    die("/proc/meminfo");
+  while (fgets(line, sizeof(line), f))
+    if (sscanf(line, "Slab: %lld kB", &kb) == 1)
+      break;
+  fclose(f);
+  if (kb < 0) {
+    fprintf(stderr, "footprint: no Slab in /proc/meminfo\n");
+    exit(1);
+  }
+  return kb * 1024;
+}
+
+/**
+ * footprint: kernel memory per empty file, measured as the growth of the
+ * slab caches while -n files are created in a directory of their own.
+ * Reported as files per GiB, so more is better like for the other tests.
+ * Other activity on the system adds noise, use a large -n.
+ **/
+static int bench_footprint(const struct bench_opts *o) {
+  char path[4096], name[32];
+  long long before, grown;
+  double start, secs;
+  long i;
+  int fd, dfd;
+
+  snprintf(path, sizeof(path), "%s/bench.dir.footprint", o->dir);
+  if (mkdir(path, 0755) && errno != EEXIST)
+    die(path);
+  dfd = open(path, O_RDONLY | O_DIRECTORY);
+  if (dfd < 0)
+    die(path);
+
+  sync();
+  before = slab_bytes();
+  start = now();
+  for (i = 0; i < o->files; i++) {
+    snprintf(name, sizeof(name), "f%08ld", i);
+    fd = openat(dfd, name, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+      die(name);
+    close(fd);
+  }
+  secs = now() - start;
+  grown = slab_bytes() - before;
+  if (grown <= 0)
+    grown = 1;
+
+  if (json)
+    report_json("footprint", "files/GiB", o->files, secs,
+                (double)o->files * (1 << 30) / grown);
+  else
+    printf("%-10s %12ld files %8.3f s %10.0f bytes/file %10.0f files/GiB\n",
+           "footprint", o->files, secs, (double)grown / o->files,
+           (double)o->files * (1 << 30) / grown);
+
+  for (i = 0; i < o->files; i++) {
+    snprintf(name, sizeof(name), "f%08ld", i);
+    if (unlinkat(dfd, name, 0))
+      die(name);
+  }
+  close(dfd);
+  if (rmdir(path))
+    die(path);
+  return 0;
+}
+
+static const struct {
+  const char *name;
+  int (*fn)(const struct bench_opts *);
+} tests[] = {
+    {"write", bench_write},
+    {"writev", bench_writev},
+    {"read", bench_read},
+    {"preadv", bench_preadv},
+    {"randwrite", bench_randwrite},
+    {"randread", bench_randread},
+#ifdef HAVE_IO_URING
+    {"uring-write", bench_uring_write},
+    {"uring-randread", bench_uring_randread},
+#endif
+    {"dio", bench_dio},
+    {"sendfile", bench_sendfile},
+    {"splice", bench_splice},
+    {"mmap", bench_mmap},
+    {"pwrite-mt", bench_pwrite_mt},
+    {"append-mt", bench_append_mt},
+    {"create", bench_create},
+    {"batch", bench_batch},
+    {"footprint", bench_footprint},
+    {"stat", bench_stat},
+    {"rename", bench_rename},
+    {"readdir", bench_readdir},
+    {"unlink", bench_unlink},
+};
+
+static void usage(void) {
+  size_t i;
+
+  fprintf(stderr, "usage: nullfs-bench [-j] [-b blocksize] [-n files] "
+                  "[-q depth] [-s total] [-t threads] [-v iovcnt] <dir> "
+                  "<test>...\n\ntests:");
+  for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+    fprintf(stderr, " %s", tests[i].name);
+  fprintf(stderr, "\n");
+  exit(2);
+}
+
+static size_t parse_size(const char *s) {
+  char *end;
+  size_t v = strtoull(s, &end, 0);
+
+  switch (*end) {
+  case 'g':
+  case 'G':
+    v <<= 10;
+    /* fall through */
+  case 'm':
+  case 'M':
+    v <<= 10;
+    /* fall through */
+  case 'k':
+  case 'K':
+    v <<= 10;
+  }
+  return v;
+}
+
+int main(int argc, char **argv) {
+  struct bench_opts o = {
+      .bs = 1 << 20,
+      .total = 8ULL << 30,
+      .iovcnt = 16,
+      .threads = 4,
+      .depth = 32,
+      .files = 100000,
+  };
+  int c, i;
+  size_t t;
+
+  while ((c = getopt(argc, argv, "b:jn:q:s:t:v:")) != -1) {
+    switch (c) {
+    case 'b':
+      o.bs = parse_size(optarg);
+      break;
+    case 'j':
+      json = 1;
+      break;
+    case 'n':
+      o.files = parse_size(optarg);
+      break;
+    case 'q':
+      o.depth = atoi(optarg);
+      break;
+    case 's':
+      o.total = parse_size(optarg);
+      break;
+    case 't':
+      o.threads = atoi(optarg);
+      break;
+    case 'v':
+      o.iovcnt = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (argc - optind < 2 || o.bs == 0 || o.iovcnt < 1 || o.iovcnt > IOV_MAX ||
+      o.threads < 1 || o.files < 1 || o.depth < 1 || o.depth > 4096)
+    usage();
+  o.dir = argv[optind++];
+  set_fsname(o.dir);
+
+  for (i = optind; i < argc; i++) {
+    for (t = 0; t < sizeof(tests) / sizeof(tests[0]); t++) {
+      if (!strcmp(argv[i], tests[t].name))
+        break;
+    }
+    if (t == sizeof(tests) / sizeof(tests[0]))
+      usage();
+    if (tests[t].fn(&o))
+      return 1;
+  }
+  return 0;
+}
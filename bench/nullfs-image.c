@@ -0,0 +1,245 @@
+/*
+ *   nullfsvfs image tool.
+ *
+ *   Copyright (C) 2018  Michael Ablassmeier <abi@grinser.de>
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *
+ *
+ * Build a namespace image for the image= mount option from an existing
+ * directory tree, or print the contents of an image. The tree can be
+ * anything, including a mounted nullfsvfs: file sizes, modes and owners
+ * are recorded, file data is not.
+ *
+ *  $ nullfs-image create /srv/tree tree.img
+ *  # mount -t nullfsvfs -o image=$PWD/tree.img none /mnt
+ *  $ nullfs-image create /mnt - | nullfs-image list -
+ */
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "../nullfsvfs_image.h"
+
+static FILE *out;
+static unsigned int *dirnum; /* directory number for every nftw level */
+static size_t maxlevel;
+static unsigned int ndirs;
+static unsigned long long nr;
+
+static void die(const char *what) {
+  perror(what);
+  exit(1);
+}
+
+static FILE *open_image(const char *path, const char *mode) {
+  FILE *f;
+
+  if (!strcmp(path, "-"))
+    return *mode == 'r' ? stdin : stdout;
+  f = fopen(path, mode);
+  if (!f)
+    die(path);
+  return f;
+}
+
+static void put(const void *buf, size_t len) {
+  if (fwrite(buf, 1, len, out) != len)
+    die("write");
+}
+
+/* same encoding as new_encode_dev() in the kernel */
+static unsigned int encode_dev(dev_t dev) {
+  unsigned int ma = major(dev), mi = minor(dev);
+
+  return (mi & 0xff) | (ma << 8) | ((mi & ~0xffu) << 12);
+}
+
+static dev_t decode_dev(unsigned int dev) {
+  return makedev((dev & 0xfff00) >> 8, (dev & 0xff) | ((dev >> 12) & 0xfff00));
+}
+
+static int add(const char *path, const struct stat *st, int flag,
+               struct FTW *ftw) {
+  struct nullfs_image_entry e;
+  const char *name = path + ftw->base;
+  char target[PATH_MAX];
+  ssize_t len = 0;
+
+  if (flag == FTW_NS || flag == FTW_DNR) {
+    fprintf(stderr, "nullfs-image: %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  if ((size_t)ftw->level >= maxlevel) {
+    maxlevel = maxlevel ? maxlevel * 2 : 64;
+    dirnum = realloc(dirnum, maxlevel * sizeof(*dirnum));
+    if (!dirnum)
+      die("realloc");
+  }
+  /* the top level directory is the root of the image */
+  if (!ftw->level) {
+    dirnum[0] = ndirs++;
+    return 0;
+  }
+
+  if (S_ISLNK(st->st_mode)) {
+    len = readlink(path, target, sizeof(target));
+    if (len < 0)
+      die(path);
+    if (len == sizeof(target)) {
+      fprintf(stderr, "nullfs-image: %s: target too long\n", path);
+      return 1;
+    }
+  }
+
+  memset(&e, 0, sizeof(e));
+  e.parent = htole32(dirnum[ftw->level - 1]);
+  e.mode = htole32(st->st_mode);
+  e.uid = htole32(st->st_uid);
+  e.gid = htole32(st->st_gid);
+  if (S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode))
+    e.rdev = htole32(encode_dev(st->st_rdev));
+  e.namelen = htole16(strlen(name));
+  if (S_ISREG(st->st_mode))
+    e.size = htole64(st->st_size);
+  else if (S_ISLNK(st->st_mode))
+    e.size = htole64(len);
+  e.mtime = htole64(st->st_mtime);
+  put(&e, sizeof(e));
+  put(name, strlen(name));
+  put(target, len);
+  nr++;
+
+  if (S_ISDIR(st->st_mode))
+    dirnum[ftw->level] = ndirs++;
+  return 0;
+}
+
+static int create(const char *dir, const char *image) {
+  struct nullfs_image_header hdr;
+
+  out = open_image(image, "w");
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, NULLFS_IMAGE_MAGIC, sizeof(hdr.magic));
+  hdr.version = htole32(NULLFS_IMAGE_VERSION);
+  put(&hdr, sizeof(hdr));
+
+  /* preorder, so every directory is written before its contents */
+  if (nftw(dir, add, 64, FTW_PHYS | FTW_MOUNT))
+    exit(1);
+  if (fclose(out))
+    die("close");
+  fprintf(stderr, "%llu entries, %u directories\n", nr, ndirs);
+  return 0;
+}
+
+static void get(FILE *f, void *buf, size_t len) {
+  if (fread(buf, 1, len, f) != len) {
+    fprintf(stderr, "nullfs-image: truncated image\n");
+    exit(1);
+  }
+}
+
+static int list(const char *image) {
+  FILE *f = open_image(image, "r");
+  struct nullfs_image_header hdr;
+  struct nullfs_image_entry e;
+  char name[NAME_MAX + 1];
+  char target[PATH_MAX];
+  char **paths = NULL;
+  size_t maxdirs = 0;
+  unsigned int mode, parent;
+  size_t len;
+  char *path;
+  int c;
+
+  get(f, &hdr, sizeof(hdr));
+  if (memcmp(hdr.magic, NULLFS_IMAGE_MAGIC, sizeof(hdr.magic)) ||
+      le32toh(hdr.version) != NULLFS_IMAGE_VERSION) {
+    fprintf(stderr, "nullfs-image: %s is not a nullfsvfs image\n", image);
+    return 1;
+  }
+
+  ndirs = 0;
+  for (;;) {
+    if (ndirs == maxdirs) {
+      maxdirs = maxdirs ? maxdirs * 2 : 1024;
+      paths = realloc(paths, maxdirs * sizeof(*paths));
+      if (!paths)
+        die("realloc");
+      if (!ndirs)
+        paths[ndirs++] = "";
+    }
+    if ((c = getc(f)) == EOF)
+      break;
+    ungetc(c, f);
+    get(f, &e, sizeof(e));
+    mode = le32toh(e.mode);
+    parent = le32toh(e.parent);
+    len = le16toh(e.namelen);
+    if (!len || len > NAME_MAX || parent >= ndirs ||
+        (S_ISLNK(mode) && le64toh(e.size) >= sizeof(target))) {
+      fprintf(stderr, "nullfs-image: invalid entry %llu\n", nr);
+      return 1;
+    }
+    get(f, name, len);
+    name[len] = '\0';
+    if (asprintf(&path, "%s/%s", paths[parent], name) < 0)
+      die("asprintf");
+
+    printf("%06o %6u %6u %14llu %s", mode, le32toh(e.uid), le32toh(e.gid),
+           (unsigned long long)le64toh(e.size), path);
+    if (S_ISLNK(mode)) {
+      len = le64toh(e.size);
+      get(f, target, len);
+      printf(" -> %.*s", (int)len, target);
+    } else if (S_ISCHR(mode) || S_ISBLK(mode)) {
+      dev_t dev = decode_dev(le32toh(e.rdev));
+
+      printf(" %u:%u", major(dev), minor(dev));
+    }
+    printf("\n");
+    nr++;
+
+    if (S_ISDIR(mode))
+      paths[ndirs++] = path;
+    else
+      free(path);
+  }
+  return 0;
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: nullfs-image create <dir> <image|->\n"
+                  "       nullfs-image list <image|->\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  if (argc == 4 && !strcmp(argv[1], "create"))
+    return create(argv[2], argv[3]);
+  if (argc == 3 && !strcmp(argv[1], "list"))
+    return list(argv[2]);
+  usage();
+  return 2;
+}
@@ -0,0 +1,137 @@
+#!/bin/sh
+#
+# Run nullfs-bench against a fresh nullfsvfs mount and against tmpfs as
+# a baseline. Results are written as JSON lines, one object per test and
+# file system. With -c the nullfsvfs results are compared to an earlier
+# run and the script fails if a test got slower than the threshold.
+#
+# Needs root, the module is loaded from the source tree if it is not
+# available yet. Everything runs locally, so it works the same in a VM
+# without network access.
+#
+#  # make ko bench
+#  # bench/run.sh -o results.json
+#  # bench/run.sh -c results.json
+#
+set -e
+
+BENCHDIR=$(cd "$(dirname "$0")" && pwd)
+BENCH="$BENCHDIR/nullfs-bench"
+MODULE="$BENCHDIR/../nullfsvfs.ko"
+
+SIZE=1G
+FILES=100000
+THREADS=4
+OUTPUT=results.json
+BASELINE=
+THRESHOLD=10
+FILESYSTEMS="nullfsvfs tmpfs"
+
+TESTS="write writev read preadv randwrite randread uring-write uring-randread
+splice sendfile pwrite-mt append-mt create batch footprint stat rename readdir
+unlink"
+
+usage() {
+  cat >&2 <<EOF
+usage: $0 [-s size] [-n files] [-t threads] [-o output] [-c baseline]
+          [-p percent] [-f "nullfsvfs tmpfs"] [test...]
+
+  -s  bytes per I/O test (default $SIZE)
+  -n  files for the metadata tests (default $FILES)
+  -t  threads for the multi threaded tests (default $THREADS)
+  -o  JSON lines output file (default $OUTPUT)
+  -c  compare nullfsvfs results against an earlier output file
+  -p  allowed slowdown in percent for -c (default $THRESHOLD)
+  -f  file systems to run on (default "$FILESYSTEMS")
+EOF
+  exit 2
+}
+
+while getopts "s:n:t:o:c:p:f:h" opt; do
+  case $opt in
+  s) SIZE=$OPTARG ;;
+  n) FILES=$OPTARG ;;
+  t) THREADS=$OPTARG ;;
+  o) OUTPUT=$OPTARG ;;
+  c) BASELINE=$OPTARG ;;
+  p) THRESHOLD=$OPTARG ;;
+  f) FILESYSTEMS=$OPTARG ;;
+  *) usage ;;
+  esac
+done
+shift $((OPTIND - 1))
+[ $# -gt 0 ] && TESTS="$*"
+
+if [ "$(id -u)" -ne 0 ]; then
+  echo "$0: must be run as root" >&2
+  exit 1
+fi
+[ -x "$BENCH" ] || make -C "$BENCHDIR"
+case " $FILESYSTEMS " in
+*" nullfsvfs "*)
+  if ! grep -qw nullfsvfs /proc/filesystems; then
+    if [ -f "$MODULE" ]; then
+      insmod "$MODULE"
+    else
+      modprobe nullfsvfs
+    fi
+  fi
+  ;;
+esac
+
+MNT=$(mktemp -d /tmp/nullfs-bench.XXXXXX)
+cleanup() {
+  umount "$MNT" 2>/dev/null || true
+  rmdir "$MNT"
+}
+trap cleanup EXIT
+
+# use a new file for every run, but only replace the old one at the end
+RESULT=$(mktemp /tmp/nullfs-bench.json.XXXXXX)
+for fs in $FILESYSTEMS; do
+  mount -t "$fs" none "$MNT"
+  echo "== $fs" >&2
+  for test in $TESTS; do
+    "$BENCH" -j -s "$SIZE" -n "$FILES" -t "$THREADS" "$MNT" "$test" |
+      tee -a "$RESULT"
+    # tmpfs keeps the data, don't let the test files pile up
+    rm -f "$MNT"/bench.[!d]*
+  done
+  umount "$MNT"
+done
+mv "$RESULT" "$OUTPUT"
+
+# nullfsvfs relative to tmpfs, > 1 means nullfsvfs is faster
+awk -F'"' '
+  /"rate":/ {
+    match($0, /"rate":[0-9.]+/)
+    rate[$4, $8] = substr($0, RSTART + 7, RLENGTH - 7) + 0
+    if (!seen[$8]++)
+      order[n++] = $8
+  }
+  END {
+    printf "%-16s %14s %14s %8s\n", "test", "nullfsvfs", "tmpfs", "ratio"
+    for (i = 0; i < n; i++) {
+      t = order[i]
+      a = (("nullfsvfs", t) in rate) ? rate["nullfsvfs", t] : "-"
+      b = (("tmpfs", t) in rate) ? rate["tmpfs", t] : "-"
+      printf "%-16s %14s %14s %8s\n", t, a, b,
+             (a != "-" && b != "-" && b > 0) ? sprintf("%.2f", a / b) : "-"
+    }
+  }' "$OUTPUT" >&2
+
+[ -n "$BASELINE" ] || exit 0
+awk -F'"' -v pct="$THRESHOLD" '
+  /"rate":/ && $4 == "nullfsvfs" {
+    match($0, /"rate":[0-9.]+/)
+    r = substr($0, RSTART + 7, RLENGTH - 7) + 0
+    if (FILENAME == ARGV[1]) {
+      base[$8] = r
+      next
+    }
+    if (base[$8] > 0 && r < base[$8] * (100 - pct) / 100) {
+      printf "REGRESSION %-16s %14s -> %14s\n", $8, base[$8], r
+      bad = 1
+    }
+  }
+  END { exit bad }' "$BASELINE" "$OUTPUT" >&2
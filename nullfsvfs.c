@@ -22,31 +22,95 @@
  * written data is sent to a blackhole. May be used for performance
  * testing etc..
  */
+#include <linux/debugfs.h>
+#include <linux/falloc.h>
 #include <linux/fs.h>
 #include <linux/fs_struct.h>
+#include <linux/hash.h>
+#include <linux/hrtimer.h>
 #include <linux/init.h>
+#include <linux/jump_label.h>
 #include <linux/kernel.h>
 #include <linux/kobject.h>
 #include <linux/module.h>
+#include <linux/mm.h>
+#include <linux/mount.h>
+#include <linux/namei.h>
 #include <linux/pagemap.h>
 #include <linux/parser.h>
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
+#include <linux/pipe_fs_i.h>
 #include <linux/posix_acl.h>
 #include <linux/posix_acl_xattr.h>
+#include <linux/rbtree.h>
+#include <linux/sched/signal.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/splice.h>
 #include <linux/statfs.h>
 #include <linux/string.h>
 #include <linux/sysfs.h>
+#include <linux/uaccess.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/xarray.h>
+#if IS_ENABLED(CONFIG_XXHASH)
+#include <linux/xxhash.h>
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+#include <linux/crc32.h>
+#define NULLFS_HAVE_CRC32C IS_ENABLED(CONFIG_CRC32)
+#else
+#include <linux/crc32c.h>
+#define NULLFS_HAVE_CRC32C IS_ENABLED(CONFIG_LIBCRC32C)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+#include <linux/fiemap.h>
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0)
+#include <linux/pfn_t.h>
+#endif
+
+/* cache=writeback needs writeback_iter() and the folio based aops */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+#include <linux/backing-dev.h>
+#include <linux/pagevec.h>
+#include <linux/writeback.h>
+#define NULLFS_HAVE_WRITEBACK 1
+#else
+#define NULLFS_HAVE_WRITEBACK 0
+#endif
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(7, 0, 0)
 #include <linux/fs_context.h>
 #include <linux/fs_parser.h>
 #endif
 
+#define CREATE_TRACE_POINTS
+#include "nullfsvfs_trace.h"
+
+#include "nullfsvfs_image.h"
+#include "nullfsvfs_kunit.h"
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
+#define inode_lock(inode) mutex_lock(&(inode)->i_mutex)
+#define inode_unlock(inode) mutex_unlock(&(inode)->i_mutex)
+#endif
+
+#ifndef SLAB_ACCOUNT
+#define SLAB_ACCOUNT 0
+#endif
+
 #define NULLFS_MAGIC 0x19980123
 #define NULLFS_DEFAULT_MODE 0755
+#define NULLFS_DEFAULT_DIO_ALIGN 512
 #define NULLFS_SYSFS_MODE 0644
+#define NULLFS_XATTR_CHECKSUM "user.nullfs.checksum"
 #define NULLFS_VERSION "0.27"
 
 MODULE_AUTHOR("Michael Ablassmeier");
@@ -54,18 +118,171 @@ MODULE_LICENSE("GPL");
 MODULE_VERSION(NULLFS_VERSION);
 MODULE_DESCRIPTION("NULLFS VFS test file system");
 
-static char exclude[100] = "\0";
+struct nullfs_patterns;
+/* patterns set via /sys/fs/nullfsvfs/exclude, applied to all mounts */
+static struct nullfs_patterns __rcu *nullfs_exclude;
 
 struct nullfs_mount_opts {
   char *write;
   umode_t mode;
   kuid_t uid;
   kgid_t gid;
+  u64 bw;
+  u64 iops;
+  u64 lat;
+  u64 fsync_lat;
+  u64 keep_max;
+  int keep_policy;
+  u64 size;
+  u64 nr_inodes;
+  bool enforce;
+  int checksum;
+  int pattern;
+  bool sparse;
+  u32 dio_align; /* logical block size O_DIRECT must be aligned to */
+  bool stats;
+  int cache;
+  char *image; /* namespace image loaded at mount time */
+};
+
+enum nullfs_keep_policy {
+  NULLFS_KEEP_ENOSPC,
+  NULLFS_KEEP_NULL,
+};
+
+enum nullfs_read_pattern {
+  NULLFS_PATTERN_NONE,
+  NULLFS_PATTERN_ZERO,
+  NULLFS_PATTERN_PRNG,
+  NULLFS_PATTERN_TEXT,
+};
+
+enum nullfs_cache_mode {
+  NULLFS_CACHE_NONE,
+  NULLFS_CACHE_WRITEBACK,
+};
+
+enum nullfs_checksum {
+  NULLFS_CSUM_NONE,
+  NULLFS_CSUM_CRC32C,
+  NULLFS_CSUM_XXHASH64,
+};
+
+/**
+ * token bucket used to emulate the bandwidth and iops limits of
+ * a real device, see nullfs_throttle()
+ **/
+struct nullfs_bucket {
+  u64 rate;
+  atomic64_t tat;
+  s64 __percpu *cache;
 };
 
+struct nullfs_pid_table;
+struct nullfs_lat;
+
 struct nullfs_fs_info {
   struct nullfs_mount_opts mount_opts;
+  struct nullfs_bucket bw;
+  struct nullfs_bucket iops;
+  struct nullfs_patterns __rcu *keep;
+  struct percpu_counter inodes;
+  struct percpu_counter keep_used;
+  struct percpu_counter bytes;
+  atomic64_t next_ino;
+  u64 __percpu *ino_batch;
+  struct kobject kobj;
+  struct completion kobj_unregister;
+  bool kobj_registered;
+  struct nullfs_pid_table __percpu *pid_stats;
+  struct dentry *debugfs;
+  u32 stats_top;
+  struct mutex stats_lock; /* protects stats_files */
+  struct list_head stats_files;
+  struct nullfs_lat __percpu *lat;
+  bool lat_on;
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 1, 0)
+struct nullfs_dir {
+  struct xarray entries;
+  u32 next;
 };
+#endif
+
+struct nullfs_csum;
+struct nullfs_extents;
+struct nullfs_file_stats;
+
+/**
+ * per file state only kept files, checksums, sparse files and the stats
+ * option need, allocated on first use by nullfs_file_ext_get()
+ **/
+struct nullfs_file_ext {
+  u64 charged; /* bytes charged against keep_max */
+  bool nulled; /* kept file which fell back to nulling */
+  struct nullfs_csum *csum;
+  struct nullfs_extents *extents;
+  struct nullfs_file_stats *stats;
+};
+
+struct nullfs_file {
+  atomic64_t accounted; /* size accounted in nullfs_fs_info bytes */
+  struct nullfs_file_ext *ext;
+};
+
+/**
+ * in-core inode, allocated from nullfs_inode_cachep. Millions of plain
+ * files are the common case, so next to the vfs inode there are only two
+ * words, whose meaning depends on the type of the inode. Directories
+ * keep their index in a separate allocation.
+ **/
+struct nullfs_inode_info {
+  union {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 1, 0)
+    struct nullfs_dir *dir;
+#endif
+    struct nullfs_file file;
+    char link[sizeof(struct nullfs_file)]; /* short symlink targets */
+  };
+  struct inode vfs_inode;
+};
+
+static struct kmem_cache *nullfs_inode_cachep;
+
+static inline struct nullfs_inode_info *NULLFS_I(struct inode *inode) {
+  return container_of(inode, struct nullfs_inode_info, vfs_inode);
+}
+
+static inline struct nullfs_file_ext *nullfs_file_ext(struct inode *inode) {
+  return READ_ONCE(NULLFS_I(inode)->file.ext);
+}
+
+static struct nullfs_file_ext *nullfs_file_ext_get(struct inode *inode,
+                                                   gfp_t gfp) {
+  struct nullfs_file_ext *ext = nullfs_file_ext(inode), *old;
+
+  if (ext)
+    return ext;
+  ext = kzalloc(sizeof(*ext), gfp);
+  if (!ext)
+    return NULL;
+  old = cmpxchg(&NULLFS_I(inode)->file.ext, NULL, ext);
+  if (old) {
+    kfree(ext);
+    return old;
+  }
+  return ext;
+}
+
+/* kept file which fell back to nulling */
+static inline bool nullfs_nulled(struct inode *inode) {
+  struct nullfs_file_ext *ext = nullfs_file_ext(inode);
+
+  return ext && READ_ONCE(ext->nulled);
+}
+
+static void nullfs_free_fsi(struct nullfs_fs_info *fsi);
 
 struct inode *nullfs_get_inode(struct super_block *, const struct inode *,
                                umode_t, dev_t, struct dentry *);
@@ -77,20 +294,82 @@ static int nullfs_get_tree(struct fs_context *fc) {
   return get_tree_single(fc, nullfs_fill_super);
 }
 
-static void nullfs_free_fc(struct fs_context *fc) { kfree(fc->s_fs_info); }
+static void nullfs_free_fc(struct fs_context *fc) {
+  nullfs_free_fsi(fc->s_fs_info);
+}
+
+static int nullfs_parse_size(const char *str, u64 *val);
+static int nullfs_parse_duration(const char *str, u64 *ns);
+static int nullfs_add_pattern(char **list, const char *pattern);
+static int nullfs_check_checksum(int checksum);
+static int nullfs_check_dio_align(u32 align);
+static int nullfs_check_cache(int cache);
 
 enum nullfs_param {
   Opt_mode,
   Opt_uid,
   Opt_gid,
   Opt_write,
+  Opt_bw,
+  Opt_iops,
+  Opt_lat,
+  Opt_fsync_lat,
+  Opt_keep_max,
+  Opt_keep_policy,
+  Opt_size,
+  Opt_nr_inodes,
+  Opt_enforce,
+  Opt_checksum,
+  Opt_pattern,
+  Opt_sparse,
+  Opt_dio_align,
+  Opt_stats,
+  Opt_cache,
+  Opt_image,
 };
 
+static const struct constant_table nullfs_keep_policies[] = {
+    {"enospc", NULLFS_KEEP_ENOSPC},
+    {"null", NULLFS_KEEP_NULL},
+    {}};
+
+static const struct constant_table nullfs_read_patterns[] = {
+    {"zero", NULLFS_PATTERN_ZERO},
+    {"prng", NULLFS_PATTERN_PRNG},
+    {"text", NULLFS_PATTERN_TEXT},
+    {}};
+
+static const struct constant_table nullfs_cache_modes[] = {
+    {"none", NULLFS_CACHE_NONE},
+    {"writeback", NULLFS_CACHE_WRITEBACK},
+    {}};
+
+static const struct constant_table nullfs_checksums[] = {
+    {"crc32c", NULLFS_CSUM_CRC32C},
+    {"xxhash64", NULLFS_CSUM_XXHASH64},
+    {}};
+
 const struct fs_parameter_spec nullfs_fs_parameters[] = {
     fsparam_u32oct("mode", Opt_mode),
     fsparam_uid("uid", Opt_uid),
     fsparam_gid("gid", Opt_gid),
     fsparam_string("write", Opt_write),
+    fsparam_string("bw", Opt_bw),
+    fsparam_u64("iops", Opt_iops),
+    fsparam_string("lat", Opt_lat),
+    fsparam_string("fsync_lat", Opt_fsync_lat),
+    fsparam_string("keep_max", Opt_keep_max),
+    fsparam_enum("keep_policy", Opt_keep_policy, nullfs_keep_policies),
+    fsparam_string("size", Opt_size),
+    fsparam_string("nr_inodes", Opt_nr_inodes),
+    fsparam_flag("enforce", Opt_enforce),
+    fsparam_enum("checksum", Opt_checksum, nullfs_checksums),
+    fsparam_enum("pattern", Opt_pattern, nullfs_read_patterns),
+    fsparam_flag("sparse", Opt_sparse),
+    fsparam_u32("dio_align", Opt_dio_align),
+    fsparam_flag("stats", Opt_stats),
+    fsparam_enum("cache", Opt_cache, nullfs_cache_modes),
+    fsparam_string("image", Opt_image),
     {}};
 
 static int nullfs_parse_param(struct fs_context *fc,
@@ -120,8 +399,50 @@ static int nullfs_parse_param(struct fs_context *fc,
     fsi->mount_opts.gid = result.gid;
     break;
   case Opt_write:
-    fsi->mount_opts.write = param->string;
-    strscpy(exclude, param->string, strlen(param->string));
+    return nullfs_add_pattern(&fsi->mount_opts.write, param->string);
+  case Opt_bw:
+    return nullfs_parse_size(param->string, &fsi->mount_opts.bw);
+  case Opt_iops:
+    fsi->mount_opts.iops = result.uint_64;
+    break;
+  case Opt_lat:
+    return nullfs_parse_duration(param->string, &fsi->mount_opts.lat);
+  case Opt_fsync_lat:
+    return nullfs_parse_duration(param->string, &fsi->mount_opts.fsync_lat);
+  case Opt_keep_max:
+    return nullfs_parse_size(param->string, &fsi->mount_opts.keep_max);
+  case Opt_keep_policy:
+    fsi->mount_opts.keep_policy = result.uint_32;
+    break;
+  case Opt_size:
+    return nullfs_parse_size(param->string, &fsi->mount_opts.size);
+  case Opt_nr_inodes:
+    return nullfs_parse_size(param->string, &fsi->mount_opts.nr_inodes);
+  case Opt_enforce:
+    fsi->mount_opts.enforce = true;
+    break;
+  case Opt_checksum:
+    fsi->mount_opts.checksum = result.uint_32;
+    return nullfs_check_checksum(fsi->mount_opts.checksum);
+  case Opt_pattern:
+    fsi->mount_opts.pattern = result.uint_32;
+    break;
+  case Opt_sparse:
+    fsi->mount_opts.sparse = true;
+    break;
+  case Opt_dio_align:
+    fsi->mount_opts.dio_align = result.uint_32;
+    return nullfs_check_dio_align(fsi->mount_opts.dio_align);
+  case Opt_stats:
+    fsi->mount_opts.stats = true;
+    break;
+  case Opt_cache:
+    fsi->mount_opts.cache = result.uint_32;
+    return nullfs_check_cache(fsi->mount_opts.cache);
+  case Opt_image:
+    kfree(fsi->mount_opts.image);
+    fsi->mount_opts.image = param->string;
+    param->string = NULL;
     break;
   }
 
@@ -142,6 +463,7 @@ int nullfs_init_fs_context(struct fs_context *fc) {
     return -ENOMEM;
 
   fsi->mount_opts.mode = NULLFS_DEFAULT_MODE;
+  fsi->mount_opts.dio_align = NULLFS_DEFAULT_DIO_ALIGN;
   fc->s_fs_info = fsi;
   fc->ops = &nullfs_context_ops;
   return 0;
@@ -159,13 +481,15 @@ int nullfs_fill_super(struct super_block *, void *, int);
  * redefine some non-public functions to make it "work", so we skip..
  */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+static const struct xattr_handler nullfs_csum_xattr_handler;
+
 static const struct xattr_handler *nullfs_xattr_handlers[] = {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 2)
     &nop_posix_acl_access, &nop_posix_acl_default,
 #else
     &posix_acl_access_xattr_handler, &posix_acl_default_xattr_handler,
 #endif
-    NULL};
+    &nullfs_csum_xattr_handler, NULL};
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
 static int nullfs_set_acl(struct mnt_idmap *idmap, struct dentry *dentry,
                           struct posix_acl *acl, int type)
@@ -184,132 +508,3336 @@ static int nullfs_set_acl(struct inode *inode, struct posix_acl *acl, int type)
 }
 #endif
 
+/**
+ * keep-data patterns
+ *
+ * write= may be given multiple times, each pattern is one of:
+ *
+ *   foo        name contains foo (as before)
+ *   foo*       name starts with foo
+ *   *foo       name ends with foo
+ *   f?o*.log   glob with * and ?, matched against the whole name
+ *   re:^f.o$   regular expression, see nullfs_re_compile()
+ *
+ * All patterns of a mount are compiled into one nullfs_patterns set that
+ * is published via RCU: creates match lockless while sysfs writers build
+ * a new set and swap it in.
+ **/
+enum nullfs_pattern_type {
+  NULLFS_PAT_SUBSTR,
+  NULLFS_PAT_PREFIX,
+  NULLFS_PAT_SUFFIX,
+  NULLFS_PAT_GLOB,
+  NULLFS_PAT_REGEX,
+};
+
+/**
+ * the regex flavour is deliberately small: literals, '.', bracket
+ * classes and the *, + and ? quantifiers, optionally anchored with ^
+ * and $. No groups or alternation, so the states of the automaton fit
+ * into a single u64 and matching is a linear walk over the name without
+ * any recursion or backtracking.
+ **/
+#define NULLFS_RE_MAX 63
+
+struct nullfs_re {
+  unsigned int nr;
+  bool bol;
+  bool eol;
+  u64 skip; /* atoms which may match nothing: * and ? */
+  u64 loop; /* atoms which may repeat: * and + */
+  struct {
+    DECLARE_BITMAP(set, 256);
+  } atom[NULLFS_RE_MAX];
+};
+
+struct nullfs_pattern {
+  enum nullfs_pattern_type type;
+  const char *str;
+  unsigned int len;
+  const char *src; /* the pattern as given, for show_options */
+  unsigned int srclen;
+  struct nullfs_re *re;
+};
+
+struct nullfs_patterns {
+  struct rcu_head rcu;
+  char *source; /* newline separated, as given by the user */
+  unsigned int nr;
+  struct nullfs_pattern pat[];
+};
+
+static DEFINE_MUTEX(nullfs_patterns_lock);
+
+static int nullfs_re_class(const char **pp, unsigned long *set) {
+  const char *p = *pp;
+  unsigned char lo, hi;
+  bool negate = false;
+
+  if (*p == '^') {
+    negate = true;
+    p++;
+  }
+  if (*p == ']')
+    __set_bit(*p++, set);
+  while (*p && *p != ']') {
+    if (*p == '\\' && p[1])
+      p++;
+    lo = hi = *p++;
+    if (*p == '-' && p[1] && p[1] != ']') {
+      hi = p[1];
+      p += 2;
+    }
+    if (lo > hi)
+      return -EINVAL;
+    bitmap_set(set, lo, hi - lo + 1);
+  }
+  if (*p != ']')
+    return -EINVAL;
+  if (negate)
+    bitmap_complement(set, set, 256);
+  *pp = p + 1;
+  return 0;
+}
+
+static struct nullfs_re *nullfs_re_compile(const char *p) {
+  struct nullfs_re *re;
+  unsigned long *set;
+
+  re = kzalloc(sizeof(*re), GFP_KERNEL);
+  if (!re)
+    return ERR_PTR(-ENOMEM);
+
+  if (*p == '^') {
+    re->bol = true;
+    p++;
+  }
+  while (*p) {
+    if (*p == '$' && !p[1]) {
+      re->eol = true;
+      break;
+    }
+    if (re->nr == NULLFS_RE_MAX)
+      goto einval;
+    set = re->atom[re->nr].set;
+    switch (*p) {
+    case '.':
+      bitmap_fill(set, 256);
+      p++;
+      break;
+    case '[':
+      p++;
+      if (nullfs_re_class(&p, set))
+        goto einval;
+      break;
+    case '\\':
+      if (!p[1])
+        goto einval;
+      __set_bit((unsigned char)p[1], set);
+      p += 2;
+      break;
+    case '*':
+    case '+':
+    case '?':
+    case '(':
+    case ')':
+    case '|':
+    case '{':
+      goto einval;
+    default:
+      __set_bit((unsigned char)*p++, set);
+    }
+    switch (*p) {
+    case '*':
+      re->skip |= BIT_ULL(re->nr);
+      re->loop |= BIT_ULL(re->nr);
+      p++;
+      break;
+    case '+':
+      re->loop |= BIT_ULL(re->nr);
+      p++;
+      break;
+    case '?':
+      re->skip |= BIT_ULL(re->nr);
+      p++;
+      break;
+    }
+    re->nr++;
+  }
+  return re;
+
+einval:
+  kfree(re);
+  return ERR_PTR(-EINVAL);
+}
+
+/* add the states reachable by skipping optional atoms */
+static u64 nullfs_re_closure(const struct nullfs_re *re, u64 states) {
+  unsigned int i;
+
+  for (i = 0; i < re->nr; i++)
+    if ((states & BIT_ULL(i)) && (re->skip & BIT_ULL(i)))
+      states |= BIT_ULL(i + 1);
+  return states;
+}
+
+static bool nullfs_re_match(const struct nullfs_re *re, const unsigned char *s,
+                            unsigned int len) {
+  u64 accept = BIT_ULL(re->nr);
+  u64 start = nullfs_re_closure(re, 1);
+  u64 cur = start, next, todo;
+  unsigned int i, n;
+
+  for (n = 0;; n++) {
+    if ((cur & accept) && (!re->eol || n == len))
+      return true;
+    if (n == len)
+      return false;
+    next = 0;
+    todo = cur & ~accept;
+    while (todo) {
+      i = __ffs64(todo);
+      todo &= todo - 1;
+      if (!test_bit(s[n], re->atom[i].set))
+        continue;
+      next |= BIT_ULL(i + 1);
+      if (re->loop & BIT_ULL(i))
+        next |= BIT_ULL(i);
+    }
+    cur = nullfs_re_closure(re, next);
+    if (!re->bol)
+      cur |= start;
+    if (!cur)
+      return false;
+  }
+}
+
+static bool nullfs_glob_match(const char *pat, unsigned int plen,
+                              const char *s, unsigned int len) {
+  unsigned int p = 0, n = 0, star = UINT_MAX, mark = 0;
+
+  while (n < len) {
+    if (p < plen && (pat[p] == '?' || pat[p] == s[n])) {
+      p++;
+      n++;
+    } else if (p < plen && pat[p] == '*') {
+      star = p++;
+      mark = n;
+    } else if (star != UINT_MAX) {
+      p = star + 1;
+      n = ++mark;
+    } else {
+      return false;
+    }
+  }
+  while (p < plen && pat[p] == '*')
+    p++;
+  return p == plen;
+}
+
+/**
+ * patterns without wildcards in the middle are reduced to plain
+ * substring, prefix or suffix compares, everything else is a glob
+ **/
+static void nullfs_pattern_classify(struct nullfs_pattern *pat, char *str) {
+  unsigned int len = strlen(str);
+  unsigned int lead = 0, trail = 0;
+
+  while (lead < len && str[lead] == '*')
+    lead++;
+  while (trail < len - lead && str[len - trail - 1] == '*')
+    trail++;
+
+  pat->str = str;
+  pat->len = len;
+  if (strchr(str, '?') || memchr(str + lead, '*', len - lead - trail)) {
+    pat->type = NULLFS_PAT_GLOB;
+    return;
+  }
+  str[len - trail] = '\0';
+  pat->str = str + lead;
+  pat->len = len - lead - trail;
+  if (lead && !trail)
+    pat->type = NULLFS_PAT_SUFFIX;
+  else if (trail && !lead)
+    pat->type = NULLFS_PAT_PREFIX;
+  else
+    pat->type = NULLFS_PAT_SUBSTR;
+}
+
+VISIBLE_IF_KUNIT void nullfs_patterns_free(struct nullfs_patterns *set) {
+  unsigned int i;
+
+  if (!set)
+    return;
+  for (i = 0; i < set->nr; i++)
+    kfree(set->pat[i].re);
+  kfree(set);
+}
+EXPORT_SYMBOL_IF_KUNIT(nullfs_patterns_free);
+
+static void nullfs_patterns_free_rcu(struct rcu_head *head) {
+  nullfs_patterns_free(container_of(head, struct nullfs_patterns, rcu));
+}
+
+/**
+ * compile a newline separated list of patterns, empty lines are ignored.
+ * Returns NULL if the list holds no pattern at all.
+ **/
+VISIBLE_IF_KUNIT struct nullfs_patterns *
+nullfs_patterns_compile(const char *source) {
+  struct nullfs_patterns *set;
+  struct nullfs_pattern *pat;
+  size_t len = strlen(source);
+  unsigned int nr = 0;
+  const char *p;
+  char *split, *line;
+
+  while (len && source[len - 1] == '\n')
+    len--;
+  for (p = source; p < source + len; p++)
+    if (*p != '\n' && (p + 1 == source + len || p[1] == '\n'))
+      nr++;
+  if (!nr)
+    return NULL;
+
+  set = kzalloc(sizeof(*set) + nr * sizeof(set->pat[0]) + 2 * (len + 1),
+                GFP_KERNEL);
+  if (!set)
+    return ERR_PTR(-ENOMEM);
+  set->source = (char *)&set->pat[nr];
+  split = set->source + len + 1;
+  memcpy(set->source, source, len);
+  memcpy(split, source, len);
+
+  while ((line = strsep(&split, "\n")) != NULL) {
+    if (!*line)
+      continue;
+    pat = &set->pat[set->nr++];
+    pat->src = set->source + (line - (set->source + len + 1));
+    pat->srclen = strlen(line);
+    if (!strncmp(line, "re:", 3)) {
+      pat->type = NULLFS_PAT_REGEX;
+      pat->re = nullfs_re_compile(line + 3);
+      if (IS_ERR(pat->re)) {
+        long err = PTR_ERR(pat->re);
+
+        pat->re = NULL;
+        nullfs_patterns_free(set);
+        return ERR_PTR(err);
+      }
+    } else {
+      nullfs_pattern_classify(pat, line);
+    }
+  }
+  return set;
+}
+EXPORT_SYMBOL_IF_KUNIT(nullfs_patterns_compile);
+
+VISIBLE_IF_KUNIT bool nullfs_patterns_match(const struct nullfs_patterns *set,
+                                            const struct qstr *name) {
+  const struct nullfs_pattern *pat;
+  const char *s = (const char *)name->name;
+  unsigned int i;
+
+  if (!set)
+    return false;
+  for (i = 0; i < set->nr; i++) {
+    pat = &set->pat[i];
+    switch (pat->type) {
+    case NULLFS_PAT_SUBSTR:
+      if (strstr(s, pat->str))
+        return true;
+      break;
+    case NULLFS_PAT_PREFIX:
+      if (name->len >= pat->len && !memcmp(s, pat->str, pat->len))
+        return true;
+      break;
+    case NULLFS_PAT_SUFFIX:
+      if (name->len >= pat->len &&
+          !memcmp(s + name->len - pat->len, pat->str, pat->len))
+        return true;
+      break;
+    case NULLFS_PAT_GLOB:
+      if (nullfs_glob_match(pat->str, pat->len, s, name->len))
+        return true;
+      break;
+    case NULLFS_PAT_REGEX:
+      if (nullfs_re_match(pat->re, name->name, name->len))
+        return true;
+      break;
+    }
+  }
+  return false;
+}
+EXPORT_SYMBOL_IF_KUNIT(nullfs_patterns_match);
+
+static void nullfs_patterns_replace(struct nullfs_patterns __rcu **slot,
+                                    struct nullfs_patterns *set) {
+  struct nullfs_patterns *old;
+
+  mutex_lock(&nullfs_patterns_lock);
+  old = rcu_dereference_protected(*slot,
+                                  lockdep_is_held(&nullfs_patterns_lock));
+  rcu_assign_pointer(*slot, set);
+  mutex_unlock(&nullfs_patterns_lock);
+  if (old)
+    call_rcu(&old->rcu, nullfs_patterns_free_rcu);
+}
+
+static ssize_t nullfs_patterns_show(struct nullfs_patterns __rcu **slot,
+                                    char *buf) {
+  struct nullfs_patterns *set;
+  ssize_t len = 0;
+
+  rcu_read_lock();
+  set = rcu_dereference(*slot);
+  if (set)
+    len = scnprintf(buf, PAGE_SIZE, "%s\n", set->source);
+  rcu_read_unlock();
+  return len;
+}
+
+static ssize_t nullfs_patterns_store(struct nullfs_patterns __rcu **slot,
+                                     const char *buf, size_t count) {
+  struct nullfs_patterns *set;
+
+  set = nullfs_patterns_compile(buf);
+  if (IS_ERR(set))
+    return PTR_ERR(set);
+  nullfs_patterns_replace(slot, set);
+  if (set)
+    printk(KERN_INFO "nullfsvfs: will keep data for files matching: [%s]\n",
+           set->source);
+  return count;
+}
+
+/* append a pattern given via write= to the newline separated list */
+static int nullfs_add_pattern(char **list, const char *pattern) {
+  char *s;
+
+  if (*list)
+    s = kasprintf(GFP_KERNEL, "%s\n%s", *list, pattern);
+  else
+    s = kstrdup(pattern, GFP_KERNEL);
+  if (!s)
+    return -ENOMEM;
+  kfree(*list);
+  *list = s;
+  return 0;
+}
+
+static bool nullfs_keep_data(struct nullfs_fs_info *fsi,
+                             const struct dentry *dentry) {
+  bool keep;
+
+  rcu_read_lock();
+  keep = nullfs_patterns_match(rcu_dereference(fsi->keep), &dentry->d_name) ||
+         nullfs_patterns_match(rcu_dereference(nullfs_exclude),
+                               &dentry->d_name);
+  rcu_read_unlock();
+  return keep;
+}
+
 /*
  * sysfs handlers
  */
 static ssize_t exclude_show(struct kobject *kobj, struct kobj_attribute *attr,
                             char *buf) {
-  return sprintf(buf, "%s", exclude);
+  return nullfs_patterns_show(&nullfs_exclude, buf);
 }
 
 static ssize_t exclude_store(struct kobject *kobj, struct kobj_attribute *attr,
                              const char *buf, size_t count) {
-  char *p;
-  p = strchr(buf, '\n');
-  if (p)
-    *p = '\0';
-  strscpy(exclude, buf, sizeof(exclude));
-  printk(KERN_INFO "nullfsvfs: will keep data for files matching: [%s]\n",
-         exclude);
-  return count;
+  return nullfs_patterns_store(&nullfs_exclude, buf, count);
+}
+
+static struct kobj_attribute exclude_attribute =
+    __ATTR(exclude, NULLFS_SYSFS_MODE, exclude_show, exclude_store);
+
+static struct attribute *attrs[] = {
+    &exclude_attribute.attr,
+    NULL, /* need to NULL terminate the list of attributes */
+};
+
+static struct attribute_group attr_group = {
+    .attrs = attrs,
+};
+
+static struct kobject *exclude_kobj;
+
+/**
+ * mount option helpers, sizes accept the usual K/M/G suffixes,
+ * durations ns/us/ms/s (default ns)
+ **/
+static int nullfs_parse_size(const char *str, u64 *val) {
+  char *end;
+
+  *val = memparse(str, &end);
+  if (end == str || *end)
+    return -EINVAL;
+  return 0;
+}
+
+/* the checksum libraries are optional, refuse what is not there */
+static int nullfs_check_checksum(int checksum) {
+  if (checksum == NULLFS_CSUM_CRC32C && !NULLFS_HAVE_CRC32C)
+    goto unsupported;
+  if (checksum == NULLFS_CSUM_XXHASH64 && !IS_ENABLED(CONFIG_XXHASH))
+    goto unsupported;
+  return 0;
+
+unsupported:
+  printk(KERN_ERR "nullfsvfs: checksum not supported by this kernel\n");
+  return -EINVAL;
+}
+
+static int nullfs_check_dio_align(u32 align) {
+  if (align < 512 || align > 65536 || (align & (align - 1))) {
+    printk(KERN_ERR "nullfsvfs: dio_align must be a power of 2 "
+                    "between 512 and 65536\n");
+    return -EINVAL;
+  }
+  return 0;
+}
+
+static int nullfs_check_cache(int cache) {
+  if (cache == NULLFS_CACHE_WRITEBACK && !NULLFS_HAVE_WRITEBACK) {
+    printk(KERN_ERR "nullfsvfs: cache=writeback needs kernel 6.11 or newer\n");
+    return -EINVAL;
+  }
+  return 0;
+}
+
+/* options for nulled files only, they would not apply to cached files */
+static int nullfs_check_writeback(struct nullfs_mount_opts *opts) {
+  if (opts->cache != NULLFS_CACHE_WRITEBACK)
+    return 0;
+  if (opts->checksum != NULLFS_CSUM_NONE ||
+      opts->pattern != NULLFS_PATTERN_NONE || opts->sparse ||
+      opts->dio_align != NULLFS_DEFAULT_DIO_ALIGN) {
+    printk(KERN_ERR "nullfsvfs: cache=writeback can not be combined with "
+                    "checksum=, pattern=, sparse or dio_align=\n");
+    return -EINVAL;
+  }
+  return 0;
+}
+
+static int nullfs_parse_duration(const char *str, u64 *ns) {
+  static const struct {
+    const char *unit;
+    u64 mult;
+  } units[] = {
+      {"", 1},
+      {"ns", 1},
+      {"us", NSEC_PER_USEC},
+      {"ms", NSEC_PER_MSEC},
+      {"s", NSEC_PER_SEC},
+  };
+  char *end;
+  u64 val;
+  int i;
+
+  val = simple_strtoull(str, &end, 10);
+  if (end == str)
+    return -EINVAL;
+  for (i = 0; i < ARRAY_SIZE(units); i++) {
+    if (!strcmp(end, units[i].unit)) {
+      *ns = val * units[i].mult;
+      return 0;
+    }
+  }
+  return -EINVAL;
+}
+
+/**
+ * Throttling
+ *
+ * Bandwidth and iops limits are enforced by a token bucket per limit.
+ * The bucket itself only stores the time at which all tokens handed out
+ * so far are paid for (tat), each cpu takes tokens in slices of 1ms
+ * worth of rate and serves the following requests from its local cache.
+ * That way the shared cacheline is touched about once per millisecond
+ * and cpu, no matter how many requests are issued.
+ **/
+#define NULLFS_BUCKET_SLICE 1000
+
+static int nullfs_bucket_init(struct nullfs_bucket *b, u64 rate) {
+  b->rate = rate;
+  atomic64_set(&b->tat, 0);
+  b->cache = alloc_percpu(s64);
+  if (!b->cache)
+    return -ENOMEM;
+  return 0;
+}
+
+static u64 nullfs_bucket_take(struct nullfs_bucket *b, u64 n) {
+  u64 rate = READ_ONCE(b->rate);
+  u64 grab, cost, now, start;
+  s64 tat, old, *cache;
+
+  if (!rate)
+    return 0;
+
+  cache = get_cpu_ptr(b->cache);
+  if (*cache >= n) {
+    *cache -= n;
+    put_cpu_ptr(b->cache);
+    return 0;
+  }
+  n -= *cache;
+  grab = max_t(u64, n, rate / NULLFS_BUCKET_SLICE);
+  *cache = grab - n;
+  put_cpu_ptr(b->cache);
+
+  cost = div64_u64(grab * NSEC_PER_SEC, rate);
+  now = ktime_get_ns();
+  tat = atomic64_read(&b->tat);
+  for (;;) {
+    start = max_t(u64, tat, now);
+    old = atomic64_cmpxchg(&b->tat, tat, start + cost);
+    if (old == tat)
+      break;
+    tat = old;
+  }
+  return start - now;
+}
+
+/**
+ * delays can be long, the sleep is killable so a throttled task can
+ * still be killed. Returns -EINTR if that cut the delay short.
+ **/
+static int nullfs_delay(u64 ns) {
+  ktime_t expires;
+
+  if (!ns)
+    return 0;
+  expires = ns_to_ktime(ns);
+  set_current_state(TASK_KILLABLE);
+  schedule_hrtimeout(&expires, HRTIMER_MODE_REL);
+  return fatal_signal_pending(current) ? -EINTR : 0;
+}
+
+static int nullfs_throttle(struct inode *inode, size_t bytes) {
+  struct nullfs_fs_info *fsi = inode->i_sb->s_fs_info;
+  u64 delay;
+
+  delay = max(nullfs_bucket_take(&fsi->bw, bytes),
+              nullfs_bucket_take(&fsi->iops, 1));
+  return nullfs_delay(delay + READ_ONCE(fsi->mount_opts.lat));
+}
+
+/**
+ * IOCB_NOWAIT: tell whether nullfs_throttle() would have to sleep for
+ * the request, without taking any tokens. The answer can be stale by
+ * the time the tokens are taken, the request then sleeps for a slice.
+ **/
+static bool nullfs_bucket_ready(struct nullfs_bucket *b, u64 n) {
+  if (!READ_ONCE(b->rate) || raw_cpu_read(*b->cache) >= n)
+    return true;
+  return (u64)atomic64_read(&b->tat) <= ktime_get_ns();
+}
+
+static bool nullfs_would_block(struct inode *inode, size_t bytes) {
+  struct nullfs_fs_info *fsi = inode->i_sb->s_fs_info;
+
+  return READ_ONCE(fsi->mount_opts.lat) ||
+         !nullfs_bucket_ready(&fsi->bw, bytes) ||
+         !nullfs_bucket_ready(&fsi->iops, 1);
+}
+
+/**
+ * Latency histograms
+ *
+ * Once enabled through latency_enable in sysfs, the time spent in
+ * directory operations, reads, writes and fsync is recorded into per
+ * CPU histograms. Buckets are powers of two split into four linear sub
+ * buckets, so a reported percentile is at most 25% above the real
+ * value. While no mount records latencies the only cost is a patched
+ * out branch.
+ **/
+enum nullfs_lat_op {
+  NULLFS_LAT_LOOKUP,
+  NULLFS_LAT_CREATE,
+  NULLFS_LAT_MKNOD,
+  NULLFS_LAT_MKDIR,
+  NULLFS_LAT_UNLINK,
+  NULLFS_LAT_RENAME,
+  NULLFS_LAT_READ,
+  NULLFS_LAT_WRITE,
+  NULLFS_LAT_FSYNC,
+  NULLFS_LAT_GETATTR,
+  NULLFS_LAT_NR,
+};
+
+static const char *const nullfs_lat_names[NULLFS_LAT_NR] = {
+    [NULLFS_LAT_LOOKUP] = "lookup",
+    [NULLFS_LAT_CREATE] = "create",
+    [NULLFS_LAT_MKNOD] = "mknod",
+    [NULLFS_LAT_MKDIR] = "mkdir",
+    [NULLFS_LAT_UNLINK] = "unlink",
+    [NULLFS_LAT_RENAME] = "rename",
+    [NULLFS_LAT_READ] = "read",
+    [NULLFS_LAT_WRITE] = "write",
+    [NULLFS_LAT_FSYNC] = "fsync",
+    [NULLFS_LAT_GETATTR] = "getattr",
+};
+
+#define NULLFS_LAT_SUB 2    /* log2 of the sub buckets per power of two */
+#define NULLFS_LAT_SHIFT 40 /* about 18 minutes, longer ends up in the last */
+#define NULLFS_LAT_BUCKETS                                                     \
+  ((NULLFS_LAT_SHIFT - NULLFS_LAT_SUB + 1) << NULLFS_LAT_SUB)
+
+struct nullfs_lat_hist {
+  u64 bucket[NULLFS_LAT_BUCKETS];
+  u64 sum;
+  u64 max;
+};
+
+struct nullfs_lat {
+  struct nullfs_lat_hist op[NULLFS_LAT_NR];
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 3, 0)
+static DEFINE_STATIC_KEY_FALSE(nullfs_lat_key);
+#define nullfs_lat_active() static_branch_unlikely(&nullfs_lat_key)
+#define nullfs_lat_get() static_branch_inc(&nullfs_lat_key)
+#define nullfs_lat_put() static_branch_dec(&nullfs_lat_key)
+#else
+static atomic_t nullfs_lat_users = ATOMIC_INIT(0);
+#define nullfs_lat_active() unlikely(atomic_read(&nullfs_lat_users))
+#define nullfs_lat_get() atomic_inc(&nullfs_lat_users)
+#define nullfs_lat_put() atomic_dec(&nullfs_lat_users)
+#endif
+
+static DEFINE_MUTEX(nullfs_lat_lock);
+
+static unsigned int nullfs_lat_bucket(u64 ns) {
+  unsigned int msb;
+
+  if (ns < (1 << NULLFS_LAT_SUB))
+    return ns;
+  if (ns >= 1ULL << NULLFS_LAT_SHIFT)
+    return NULLFS_LAT_BUCKETS - 1;
+  msb = fls64(ns) - 1;
+  return ((msb - NULLFS_LAT_SUB + 1) << NULLFS_LAT_SUB) |
+         ((ns >> (msb - NULLFS_LAT_SUB)) & ((1 << NULLFS_LAT_SUB) - 1));
+}
+
+/* largest latency that falls into bucket b */
+static u64 nullfs_lat_value(unsigned int b) {
+  unsigned int msb = (b >> NULLFS_LAT_SUB) + NULLFS_LAT_SUB - 1;
+  u64 sub = b & ((1 << NULLFS_LAT_SUB) - 1);
+
+  if (b < (1 << NULLFS_LAT_SUB))
+    return b;
+  return ((1ULL << msb) | (sub << (msb - NULLFS_LAT_SUB))) +
+         (1ULL << (msb - NULLFS_LAT_SUB)) - 1;
+}
+
+static void nullfs_lat_record(struct nullfs_fs_info *fsi,
+                              enum nullfs_lat_op op, u64 ns) {
+  struct nullfs_lat __percpu *lat = READ_ONCE(fsi->lat);
+  struct nullfs_lat_hist *h;
+
+  if (!lat)
+    return;
+  h = &get_cpu_ptr(lat)->op[op];
+  h->bucket[nullfs_lat_bucket(ns)]++;
+  h->sum += ns;
+  if (ns > h->max)
+    h->max = ns;
+  put_cpu_ptr(lat);
+}
+
+static inline u64 nullfs_lat_start(struct super_block *sb) {
+  struct nullfs_fs_info *fsi = sb->s_fs_info;
+
+  if (!nullfs_lat_active() || !READ_ONCE(fsi->lat_on))
+    return 0;
+  return ktime_get_ns();
+}
+
+static inline void nullfs_lat_end(struct super_block *sb,
+                                  enum nullfs_lat_op op, u64 start) {
+  if (start)
+    nullfs_lat_record(sb->s_fs_info, op, ktime_get_ns() - start);
+}
+
+static int nullfs_fsync(struct file *filp, loff_t start, loff_t end,
+                        int datasync) {
+  struct nullfs_fs_info *fsi = file_inode(filp)->i_sb->s_fs_info;
+  u64 t = nullfs_lat_start(file_inode(filp)->i_sb);
+
+  int err;
+
+  trace_nullfs_fsync(file_inode(filp), start, end, datasync);
+  err = nullfs_delay(READ_ONCE(fsi->mount_opts.fsync_lat));
+  nullfs_lat_end(file_inode(filp)->i_sb, NULLFS_LAT_FSYNC, t);
+  return err;
+}
+
+/*
+ * per mount sysfs handlers, /sys/fs/nullfsvfs/<major:minor>/
+ */
+struct nullfs_sb_attr {
+  struct attribute attr;
+  ssize_t (*show)(struct nullfs_fs_info *, char *);
+  ssize_t (*store)(struct nullfs_fs_info *, const char *, size_t);
+};
+
+#define NULLFS_SB_ATTR(_name)                                                  \
+  static struct nullfs_sb_attr nullfs_sb_attr_##_name =                        \
+      __ATTR(_name, NULLFS_SYSFS_MODE, _name##_show, _name##_store)
+
+#define NULLFS_SB_ATTR_RO(_name)                                               \
+  static struct nullfs_sb_attr nullfs_sb_attr_##_name = __ATTR_RO(_name)
+
+#define NULLFS_SB_ATTR_WO(_name)                                               \
+  static struct nullfs_sb_attr nullfs_sb_attr_##_name =                        \
+      __ATTR(_name, 0200, NULL, _name##_store)
+
+static ssize_t nullfs_store_value(const char *buf, size_t count, u64 *val,
+                                  int (*parse)(const char *, u64 *)) {
+  char tmp[32];
+  int err;
+
+  if (count >= sizeof(tmp))
+    return -EINVAL;
+  strscpy(tmp, buf, sizeof(tmp));
+  err = parse(strim(tmp), val);
+  if (err)
+    return err;
+  return count;
+}
+
+static int nullfs_parse_u64(const char *str, u64 *val) {
+  return kstrtoull(str, 0, val);
+}
+
+static ssize_t bw_show(struct nullfs_fs_info *fsi, char *buf) {
+  return sprintf(buf, "%llu\n", READ_ONCE(fsi->bw.rate));
+}
+
+static ssize_t bw_store(struct nullfs_fs_info *fsi, const char *buf,
+                        size_t count) {
+  u64 val;
+  ssize_t ret = nullfs_store_value(buf, count, &val, nullfs_parse_size);
+
+  if (ret > 0)
+    WRITE_ONCE(fsi->bw.rate, val);
+  return ret;
+}
+
+static ssize_t iops_show(struct nullfs_fs_info *fsi, char *buf) {
+  return sprintf(buf, "%llu\n", READ_ONCE(fsi->iops.rate));
+}
+
+static ssize_t iops_store(struct nullfs_fs_info *fsi, const char *buf,
+                          size_t count) {
+  u64 val;
+  ssize_t ret = nullfs_store_value(buf, count, &val, nullfs_parse_u64);
+
+  if (ret > 0)
+    WRITE_ONCE(fsi->iops.rate, val);
+  return ret;
+}
+
+static ssize_t lat_show(struct nullfs_fs_info *fsi, char *buf) {
+  return sprintf(buf, "%lluns\n", READ_ONCE(fsi->mount_opts.lat));
+}
+
+static ssize_t lat_store(struct nullfs_fs_info *fsi, const char *buf,
+                         size_t count) {
+  u64 val;
+  ssize_t ret = nullfs_store_value(buf, count, &val, nullfs_parse_duration);
+
+  if (ret > 0)
+    WRITE_ONCE(fsi->mount_opts.lat, val);
+  return ret;
+}
+
+static ssize_t fsync_lat_show(struct nullfs_fs_info *fsi, char *buf) {
+  return sprintf(buf, "%lluns\n", READ_ONCE(fsi->mount_opts.fsync_lat));
+}
+
+static ssize_t fsync_lat_store(struct nullfs_fs_info *fsi, const char *buf,
+                               size_t count) {
+  u64 val;
+  ssize_t ret = nullfs_store_value(buf, count, &val, nullfs_parse_duration);
+
+  if (ret > 0)
+    WRITE_ONCE(fsi->mount_opts.fsync_lat, val);
+  return ret;
+}
+
+static ssize_t keep_max_show(struct nullfs_fs_info *fsi, char *buf) {
+  return sprintf(buf, "%llu\n", READ_ONCE(fsi->mount_opts.keep_max));
+}
+
+static ssize_t keep_max_store(struct nullfs_fs_info *fsi, const char *buf,
+                              size_t count) {
+  u64 val;
+  ssize_t ret = nullfs_store_value(buf, count, &val, nullfs_parse_size);
+
+  if (ret > 0)
+    WRITE_ONCE(fsi->mount_opts.keep_max, val);
+  return ret;
+}
+
+static ssize_t keep_used_show(struct nullfs_fs_info *fsi, char *buf) {
+  return sprintf(buf, "%lld\n",
+                 percpu_counter_sum_positive(&fsi->keep_used));
+}
+
+static ssize_t inodes_show(struct nullfs_fs_info *fsi, char *buf) {
+  return sprintf(buf, "%lld\n", percpu_counter_sum_positive(&fsi->inodes));
+}
+
+static ssize_t bytes_per_file_show(struct nullfs_fs_info *fsi, char *buf) {
+  /**
+   * estimate: every file costs one object from the inode cache and the
+   * dentry which is pinned in the dcache, names longer than the inline
+   * name of the dentry, checksums, extents and stats need extra
+   * allocations. nullfs-bench footprint measures the real cost.
+   **/
+  return sprintf(buf, "%zu\n",
+                 kmem_cache_size(nullfs_inode_cachep) + sizeof(struct dentry));
+}
+
+static ssize_t latency_enable_show(struct nullfs_fs_info *fsi, char *buf) {
+  return sprintf(buf, "%d\n", READ_ONCE(fsi->lat_on));
+}
+
+/**
+ * the histograms are allocated the first time recording is enabled and
+ * stay around until unmount, so the recording paths never see them go
+ **/
+static ssize_t latency_enable_store(struct nullfs_fs_info *fsi,
+                                    const char *buf, size_t count) {
+  u64 val;
+  ssize_t ret = nullfs_store_value(buf, count, &val, nullfs_parse_u64);
+
+  if (ret < 0)
+    return ret;
+  mutex_lock(&nullfs_lat_lock);
+  if (val && !fsi->lat_on) {
+    if (!fsi->lat)
+      WRITE_ONCE(fsi->lat, alloc_percpu(struct nullfs_lat));
+    if (fsi->lat) {
+      nullfs_lat_get();
+      WRITE_ONCE(fsi->lat_on, true);
+    } else {
+      ret = -ENOMEM;
+    }
+  } else if (!val && fsi->lat_on) {
+    WRITE_ONCE(fsi->lat_on, false);
+    nullfs_lat_put();
+  }
+  mutex_unlock(&nullfs_lat_lock);
+  return ret;
+}
+
+static ssize_t latency_show(struct nullfs_fs_info *fsi, char *buf) {
+  static const u32 pct[] = {50000, 90000, 99000, 99900}; /* per 100000 */
+  struct nullfs_lat __percpu *lat = READ_ONCE(fsi->lat);
+  struct nullfs_lat_hist *h, *c;
+  u64 total, seen, rank;
+  int op, cpu, b, i;
+  ssize_t len;
+
+  len = sprintf(buf, "%-8s %12s %12s %12s %12s %12s %12s %12s\n", "op",
+                "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+  if (!lat)
+    return len;
+  h = kmalloc(sizeof(*h), GFP_KERNEL);
+  if (!h)
+    return -ENOMEM;
+
+  for (op = 0; op < NULLFS_LAT_NR; op++) {
+    memset(h, 0, sizeof(*h));
+    for_each_possible_cpu(cpu) {
+      c = &per_cpu_ptr(lat, cpu)->op[op];
+      for (b = 0; b < NULLFS_LAT_BUCKETS; b++)
+        h->bucket[b] += c->bucket[b];
+      h->sum += c->sum;
+      h->max = max(h->max, c->max);
+    }
+    for (total = 0, b = 0; b < NULLFS_LAT_BUCKETS; b++)
+      total += h->bucket[b];
+    if (!total)
+      continue;
+
+    len += sprintf(buf + len, "%-8s %12llu %12llu", nullfs_lat_names[op],
+                   total, div64_u64(h->sum, total));
+    for (seen = 0, b = 0, i = 0; i < ARRAY_SIZE(pct); i++) {
+      rank = div64_u64(total * pct[i] + 99999, 100000);
+      while (seen + h->bucket[b] < rank)
+        seen += h->bucket[b++];
+      len += sprintf(buf + len, " %12llu", min(nullfs_lat_value(b), h->max));
+    }
+    len += sprintf(buf + len, " %12llu\n", h->max);
+  }
+  kfree(h);
+  return len;
+}
+
+/* counts recorded while the histograms are cleared may survive */
+static ssize_t latency_reset_store(struct nullfs_fs_info *fsi,
+                                   const char *buf, size_t count) {
+  struct nullfs_lat __percpu *lat = READ_ONCE(fsi->lat);
+  int cpu;
+
+  if (lat) {
+    for_each_possible_cpu(cpu)
+      memset(per_cpu_ptr(lat, cpu), 0, sizeof(struct nullfs_lat));
+  }
+  return count;
+}
+
+static ssize_t sb_exclude_show(struct nullfs_fs_info *fsi, char *buf) {
+  return nullfs_patterns_show(&fsi->keep, buf);
+}
+
+static ssize_t sb_exclude_store(struct nullfs_fs_info *fsi, const char *buf,
+                                size_t count) {
+  return nullfs_patterns_store(&fsi->keep, buf, count);
+}
+
+static struct nullfs_sb_attr nullfs_sb_attr_exclude =
+    __ATTR(exclude, NULLFS_SYSFS_MODE, sb_exclude_show, sb_exclude_store);
+NULLFS_SB_ATTR(bw);
+NULLFS_SB_ATTR(iops);
+NULLFS_SB_ATTR(lat);
+NULLFS_SB_ATTR(fsync_lat);
+NULLFS_SB_ATTR(keep_max);
+NULLFS_SB_ATTR_RO(keep_used);
+NULLFS_SB_ATTR_RO(inodes);
+NULLFS_SB_ATTR_RO(bytes_per_file);
+NULLFS_SB_ATTR(latency_enable);
+NULLFS_SB_ATTR_RO(latency);
+NULLFS_SB_ATTR_WO(latency_reset);
+
+static struct attribute *nullfs_sb_attrs[] = {
+    &nullfs_sb_attr_exclude.attr,
+    &nullfs_sb_attr_bw.attr,
+    &nullfs_sb_attr_iops.attr,
+    &nullfs_sb_attr_lat.attr,
+    &nullfs_sb_attr_fsync_lat.attr,
+    &nullfs_sb_attr_keep_max.attr,
+    &nullfs_sb_attr_keep_used.attr,
+    &nullfs_sb_attr_inodes.attr,
+    &nullfs_sb_attr_bytes_per_file.attr,
+    &nullfs_sb_attr_latency_enable.attr,
+    &nullfs_sb_attr_latency.attr,
+    &nullfs_sb_attr_latency_reset.attr,
+    NULL,
+};
+
+static struct attribute_group nullfs_sb_attr_group = {
+    .attrs = nullfs_sb_attrs,
+};
+
+static ssize_t nullfs_sb_attr_show(struct kobject *kobj, struct attribute *attr,
+                                   char *buf) {
+  struct nullfs_fs_info *fsi = container_of(kobj, struct nullfs_fs_info, kobj);
+  struct nullfs_sb_attr *a = container_of(attr, struct nullfs_sb_attr, attr);
+
+  if (!a->show)
+    return -EPERM;
+  return a->show(fsi, buf);
+}
+
+static ssize_t nullfs_sb_attr_store(struct kobject *kobj,
+                                    struct attribute *attr, const char *buf,
+                                    size_t count) {
+  struct nullfs_fs_info *fsi = container_of(kobj, struct nullfs_fs_info, kobj);
+  struct nullfs_sb_attr *a = container_of(attr, struct nullfs_sb_attr, attr);
+
+  if (!a->store)
+    return -EPERM;
+  return a->store(fsi, buf, count);
+}
+
+static const struct sysfs_ops nullfs_sb_sysfs_ops = {
+    .show = nullfs_sb_attr_show,
+    .store = nullfs_sb_attr_store,
+};
+
+static void nullfs_sb_release(struct kobject *kobj) {
+  struct nullfs_fs_info *fsi = container_of(kobj, struct nullfs_fs_info, kobj);
+
+  complete(&fsi->kobj_unregister);
+}
+
+static struct kobj_type nullfs_sb_ktype = {
+    .sysfs_ops = &nullfs_sb_sysfs_ops,
+    .release = nullfs_sb_release,
+};
+
+static int nullfs_sysfs_register(struct super_block *sb) {
+  struct nullfs_fs_info *fsi = sb->s_fs_info;
+  int err;
+
+  init_completion(&fsi->kobj_unregister);
+  err = kobject_init_and_add(&fsi->kobj, &nullfs_sb_ktype, exclude_kobj,
+                             "%u:%u", MAJOR(sb->s_dev), MINOR(sb->s_dev));
+  if (!err)
+    err = sysfs_create_group(&fsi->kobj, &nullfs_sb_attr_group);
+  if (err) {
+    kobject_put(&fsi->kobj);
+    wait_for_completion(&fsi->kobj_unregister);
+    return err;
+  }
+  fsi->kobj_registered = true;
+  return 0;
+}
+
+static void nullfs_sysfs_unregister(struct nullfs_fs_info *fsi) {
+  if (!fsi->kobj_registered)
+    return;
+  kobject_del(&fsi->kobj);
+  kobject_put(&fsi->kobj);
+  wait_for_completion(&fsi->kobj_unregister);
+  fsi->kobj_registered = false;
+}
+
+/**
+ * I/O attribution
+ *
+ * With the stats option reads, writes and directory operations are
+ * counted per file and per process and shown below
+ * /sys/kernel/debug/nullfsvfs/<major:minor>/. File counters are per CPU
+ * and allocated with the first I/O to a file. Processes are counted in
+ * a small direct mapped table per CPU: a process taking over a slot
+ * folds the previous owner into "other", so memory stays bounded and
+ * the totals stay right no matter how many processes come and go.
+ *
+ * Files with counters are kept on a list of their own, so showing the
+ * top files only walks the files which saw I/O, and the walk can
+ * reschedule. The number of lines shown is capped at NULLFS_STATS_TOP_MAX.
+ **/
+#define NULLFS_STATS_NAME 32
+#define NULLFS_STATS_TOP 20
+#define NULLFS_STATS_TOP_MAX 1000
+#define NULLFS_PID_BITS 6
+#define NULLFS_PID_SLOTS (1 << NULLFS_PID_BITS)
+
+struct nullfs_io_stats {
+  u64 rbytes;
+  u64 wbytes;
+  u64 rops;
+  u64 wops;
+  u64 meta;
+};
+
+struct nullfs_file_stats {
+  struct nullfs_io_stats __percpu *io;
+  struct list_head list; /* on nullfs_fs_info stats_files */
+  unsigned long ino;
+  char name[NULLFS_STATS_NAME]; /* name at the time of the first I/O */
+};
+
+struct nullfs_pid_stats {
+  pid_t pid;
+  char comm[TASK_COMM_LEN];
+  struct nullfs_io_stats io;
+};
+
+struct nullfs_pid_table {
+  struct nullfs_pid_stats slot[NULLFS_PID_SLOTS];
+  struct nullfs_io_stats other;
+};
+
+static void nullfs_io_fold(struct nullfs_io_stats *dst,
+                           const struct nullfs_io_stats *src) {
+  dst->rbytes += src->rbytes;
+  dst->wbytes += src->wbytes;
+  dst->rops += src->rops;
+  dst->wops += src->wops;
+  dst->meta += src->meta;
+}
+
+static void nullfs_io_add(struct nullfs_io_stats *io, bool write,
+                          size_t bytes) {
+  if (write) {
+    io->wbytes += bytes;
+    io->wops++;
+  } else {
+    io->rbytes += bytes;
+    io->rops++;
+  }
+}
+
+/* called with preemption disabled */
+static struct nullfs_io_stats *nullfs_pid_slot(struct nullfs_pid_table *t) {
+  pid_t pid = task_tgid_nr(current);
+  struct nullfs_pid_stats *p = &t->slot[hash_32(pid, NULLFS_PID_BITS)];
+
+  if (p->pid != pid) {
+    nullfs_io_fold(&t->other, &p->io);
+    memset(&p->io, 0, sizeof(p->io));
+    p->pid = pid;
+    strscpy(p->comm, current->comm, sizeof(p->comm));
+  }
+  return &p->io;
+}
+
+static struct nullfs_file_stats *nullfs_file_stats(struct file *filp) {
+  struct inode *inode = file_inode(filp);
+  struct nullfs_fs_info *fsi = inode->i_sb->s_fs_info;
+  struct nullfs_file_ext *ext;
+  struct dentry *dentry = filp->f_path.dentry;
+  struct nullfs_file_stats *st, *old;
+
+  ext = nullfs_file_ext_get(inode, GFP_KERNEL);
+  if (!ext)
+    return NULL;
+  st = READ_ONCE(ext->stats);
+  if (st)
+    return st;
+  st = kzalloc(sizeof(*st), GFP_KERNEL);
+  if (!st)
+    return NULL;
+  st->io = alloc_percpu(struct nullfs_io_stats);
+  if (!st->io) {
+    kfree(st);
+    return NULL;
+  }
+  st->ino = inode->i_ino;
+  spin_lock(&dentry->d_lock);
+  strscpy(st->name, dentry->d_name.name, sizeof(st->name));
+  spin_unlock(&dentry->d_lock);
+
+  old = cmpxchg(&ext->stats, NULL, st);
+  if (old) {
+    free_percpu(st->io);
+    kfree(st);
+    return old;
+  }
+  mutex_lock(&fsi->stats_lock);
+  list_add_tail(&st->list, &fsi->stats_files);
+  mutex_unlock(&fsi->stats_lock);
+  return st;
+}
+
+static void nullfs_stats_free(struct nullfs_fs_info *fsi,
+                              struct nullfs_file_stats *st) {
+  if (!st)
+    return;
+  mutex_lock(&fsi->stats_lock);
+  list_del(&st->list);
+  mutex_unlock(&fsi->stats_lock);
+  free_percpu(st->io);
+  kfree(st);
+}
+
+
+static void nullfs_stats_io(struct file *filp, bool write, ssize_t bytes) {
+  struct nullfs_fs_info *fsi = file_inode(filp)->i_sb->s_fs_info;
+  struct nullfs_file_stats *st;
+  struct nullfs_pid_table *t;
+
+  if (!fsi->mount_opts.stats || bytes < 0)
+    return;
+  st = nullfs_file_stats(filp);
+  t = get_cpu_ptr(fsi->pid_stats);
+  nullfs_io_add(nullfs_pid_slot(t), write, bytes);
+  if (st)
+    nullfs_io_add(this_cpu_ptr(st->io), write, bytes);
+  put_cpu_ptr(fsi->pid_stats);
+}
+
+static void nullfs_stats_meta(struct inode *dir) {
+  struct nullfs_fs_info *fsi = dir->i_sb->s_fs_info;
+  struct nullfs_pid_table *t;
+
+  if (!fsi->mount_opts.stats)
+    return;
+  t = get_cpu_ptr(fsi->pid_stats);
+  nullfs_pid_slot(t)->meta++;
+  put_cpu_ptr(fsi->pid_stats);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+static int nullfs_stats_top(struct nullfs_fs_info *fsi) {
+  return min_t(u32, READ_ONCE(fsi->stats_top), NULLFS_STATS_TOP_MAX);
+}
+
+struct nullfs_top {
+  u64 id; /* inode or pid */
+  char name[NULLFS_STATS_NAME];
+  struct nullfs_io_stats io;
+};
+
+static u64 nullfs_top_key(const struct nullfs_top *e) {
+  return e->io.rbytes + e->io.wbytes;
+}
+
+/* keep the max entries with the most bytes, sorted descending */
+static void nullfs_top_insert(struct nullfs_top *top, int *n, int max,
+                              const struct nullfs_top *e) {
+  u64 key = nullfs_top_key(e);
+  int i;
+
+  if (*n == max && key <= nullfs_top_key(&top[max - 1]))
+    return;
+  i = *n < max ? (*n)++ : max - 1;
+  for (; i > 0 && nullfs_top_key(&top[i - 1]) < key; i--)
+    top[i] = top[i - 1];
+  top[i] = *e;
+}
+
+static void nullfs_top_show(struct seq_file *m, const char *id,
+                            const struct nullfs_top *top, int n, bool meta) {
+  int i;
+
+  seq_printf(m, "%-10s %-32s %16s %16s %12s %12s", id, "name", "read",
+             "written", "reads", "writes");
+  seq_puts(m, meta ? "       dirops\n" : "\n");
+  for (i = 0; i < n; i++) {
+    seq_printf(m, "%-10llu %-32s %16llu %16llu %12llu %12llu", top[i].id,
+               top[i].name, top[i].io.rbytes, top[i].io.wbytes,
+               top[i].io.rops, top[i].io.wops);
+    if (meta)
+      seq_printf(m, " %12llu", top[i].io.meta);
+    seq_putc(m, '\n');
+  }
+}
+
+/**
+ * the stats lock keeps the counters alive, they are taken off the list
+ * before they are freed on eviction
+ **/
+static int nullfs_files_show(struct seq_file *m, void *v) {
+  struct super_block *sb = m->private;
+  struct nullfs_fs_info *fsi = sb->s_fs_info;
+  int max = nullfs_stats_top(fsi), n = 0, cpu;
+  struct nullfs_file_stats *st;
+  struct nullfs_top *top, e;
+
+  if (!max)
+    return 0;
+  top = kvmalloc_array(max, sizeof(*top), GFP_KERNEL);
+  if (!top)
+    return -ENOMEM;
+
+  mutex_lock(&fsi->stats_lock);
+  list_for_each_entry(st, &fsi->stats_files, list) {
+    memset(&e.io, 0, sizeof(e.io));
+    for_each_possible_cpu(cpu)
+      nullfs_io_fold(&e.io, per_cpu_ptr(st->io, cpu));
+    e.id = st->ino;
+    memcpy(e.name, st->name, sizeof(e.name));
+    nullfs_top_insert(top, &n, max, &e);
+    cond_resched();
+  }
+  mutex_unlock(&fsi->stats_lock);
+
+  nullfs_top_show(m, "inode", top, n, false);
+  kvfree(top);
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(nullfs_files);
+
+static int nullfs_pid_cmp(const void *a, const void *b) {
+  const struct nullfs_pid_stats *pa = a, *pb = b;
+
+  return pa->pid - pb->pid;
+}
+
+/**
+ * the per CPU tables are read without locking, a slot that changes
+ * owner while it is copied is off for one read
+ **/
+static int nullfs_pids_show(struct seq_file *m, void *v) {
+  struct super_block *sb = m->private;
+  struct nullfs_fs_info *fsi = sb->s_fs_info;
+  int max = nullfs_stats_top(fsi), n = 0, cpu, i, nr = 0;
+  struct nullfs_pid_stats *all;
+  struct nullfs_io_stats other = {0};
+  struct nullfs_pid_table *t;
+  struct nullfs_top *top, e = {0};
+
+  if (!max)
+    return 0;
+  top = kvmalloc_array(max, sizeof(*top), GFP_KERNEL);
+  all = kvmalloc_array(num_possible_cpus() * NULLFS_PID_SLOTS, sizeof(*all),
+                       GFP_KERNEL);
+  if (!top || !all) {
+    kvfree(top);
+    kvfree(all);
+    return -ENOMEM;
+  }
+
+  for_each_possible_cpu(cpu) {
+    t = per_cpu_ptr(fsi->pid_stats, cpu);
+    nullfs_io_fold(&other, &t->other);
+    for (i = 0; i < NULLFS_PID_SLOTS; i++) {
+      if (t->slot[i].pid)
+        all[nr++] = t->slot[i];
+    }
+  }
+  sort(all, nr, sizeof(*all), nullfs_pid_cmp, NULL);
+
+  for (i = 0; i < nr; i++) {
+    if (!i || all[i].pid != all[i - 1].pid) {
+      if (i)
+        nullfs_top_insert(top, &n, max, &e);
+      memset(&e, 0, sizeof(e));
+      e.id = all[i].pid;
+      strscpy(e.name, all[i].comm, sizeof(e.name));
+    }
+    nullfs_io_fold(&e.io, &all[i].io);
+  }
+  if (nr)
+    nullfs_top_insert(top, &n, max, &e);
+
+  nullfs_top_show(m, "pid", top, n, true);
+  seq_printf(m, "%-10s %-32s %16llu %16llu %12llu %12llu %12llu\n", "-",
+             "other", other.rbytes, other.wbytes, other.rops, other.wops,
+             other.meta);
+  kvfree(all);
+  kvfree(top);
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(nullfs_pids);
+#endif
+
+static struct dentry *nullfs_debugfs_root;
+
+static void nullfs_debugfs_register(struct super_block *sb) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+  struct nullfs_fs_info *fsi = sb->s_fs_info;
+  char name[32];
+
+  if (!fsi->mount_opts.stats)
+    return;
+  snprintf(name, sizeof(name), "%u:%u", MAJOR(sb->s_dev), MINOR(sb->s_dev));
+  fsi->debugfs = debugfs_create_dir(name, nullfs_debugfs_root);
+  debugfs_create_file("files", 0444, fsi->debugfs, sb, &nullfs_files_fops);
+  debugfs_create_file("pids", 0444, fsi->debugfs, sb, &nullfs_pids_fops);
+  debugfs_create_u32("top", 0644, fsi->debugfs, &fsi->stats_top);
+#endif
+}
+
+static void nullfs_debugfs_unregister(struct nullfs_fs_info *fsi) {
+  debugfs_remove_recursive(fsi->debugfs);
+  fsi->debugfs = NULL;
+}
+
+static void nullfs_free_fsi(struct nullfs_fs_info *fsi) {
+  if (!fsi)
+    return;
+  nullfs_patterns_free(rcu_dereference_protected(fsi->keep, 1));
+  kfree(fsi->mount_opts.write);
+  kfree(fsi->mount_opts.image);
+  free_percpu(fsi->bw.cache);
+  free_percpu(fsi->iops.cache);
+  percpu_counter_destroy(&fsi->inodes);
+  percpu_counter_destroy(&fsi->keep_used);
+  percpu_counter_destroy(&fsi->bytes);
+  free_percpu(fsi->ino_batch);
+  free_percpu(fsi->pid_stats);
+  if (fsi->lat_on)
+    nullfs_lat_put();
+  free_percpu(fsi->lat);
+  kfree(fsi);
+}
+
+/**
+ * Sparse files
+ *
+ * With the sparse option every nulled file records which ranges have
+ * been written (data) and which are allocated (data plus fallocated
+ * space). Both are sets of non-overlapping ranges in an rbtree keyed by
+ * start, adjacent ranges are merged, so sequential writers only ever
+ * extend the last range they touched. The sets back SEEK_DATA/SEEK_HOLE,
+ * fiemap and st_blocks. Nodes are never allocated under the spinlock:
+ * an update that needs one more node gives up, a spare is allocated and
+ * the update is repeated, which is fine as all updates are idempotent.
+ **/
+struct nullfs_range {
+  struct rb_node node;
+  loff_t start;
+  loff_t end;
+};
+
+struct nullfs_rangeset {
+  struct rb_root root;
+  struct nullfs_range *last; /* range extended last, appends hit it */
+  u64 bytes;
+};
+
+struct nullfs_extents {
+  spinlock_t lock;
+  struct nullfs_rangeset data;
+  struct nullfs_rangeset alloc;
+};
+
+enum nullfs_extent_op {
+  NULLFS_EXT_WRITE,
+  NULLFS_EXT_ALLOC,
+  NULLFS_EXT_ZERO,
+  NULLFS_EXT_PUNCH,
+  NULLFS_EXT_COLLAPSE,
+};
+
+#define NULLFS_EXT_SPARES 2
+
+static inline struct nullfs_range *nullfs_range_next(struct nullfs_range *r) {
+  return rb_entry_safe(rb_next(&r->node), struct nullfs_range, node);
+}
+
+static inline struct nullfs_range *
+nullfs_range_first(struct nullfs_rangeset *set) {
+  return rb_entry_safe(rb_first(&set->root), struct nullfs_range, node);
+}
+
+/* last range starting at or before pos */
+static struct nullfs_range *nullfs_range_lookup(struct nullfs_rangeset *set,
+                                                loff_t pos) {
+  struct rb_node *n = set->root.rb_node;
+  struct nullfs_range *r, *found = NULL;
+
+  while (n) {
+    r = rb_entry(n, struct nullfs_range, node);
+    if (r->start <= pos) {
+      found = r;
+      n = n->rb_right;
+    } else {
+      n = n->rb_left;
+    }
+  }
+  return found;
+}
+
+static void nullfs_range_insert(struct nullfs_rangeset *set,
+                                struct nullfs_range *new) {
+  struct rb_node **p = &set->root.rb_node, *parent = NULL;
+
+  while (*p) {
+    parent = *p;
+    if (new->start < rb_entry(parent, struct nullfs_range, node)->start)
+      p = &parent->rb_left;
+    else
+      p = &parent->rb_right;
+  }
+  rb_link_node(&new->node, parent, p);
+  rb_insert_color(&new->node, &set->root);
+}
+
+static void nullfs_range_erase(struct nullfs_rangeset *set,
+                               struct nullfs_range *r) {
+  if (set->last == r)
+    set->last = NULL;
+  rb_erase(&r->node, &set->root);
+  kfree(r);
+}
+
+static struct nullfs_range *nullfs_range_spare(struct nullfs_range **spares) {
+  struct nullfs_range *r;
+  int i;
+
+  for (i = 0; i < NULLFS_EXT_SPARES; i++) {
+    if (spares[i]) {
+      r = spares[i];
+      spares[i] = NULL;
+      return r;
+    }
+  }
+  return NULL;
+}
+
+/* add [start, end) to the set, false if a spare node is needed */
+static bool nullfs_range_add(struct nullfs_rangeset *set, loff_t start,
+                             loff_t end, struct nullfs_range **spares) {
+  struct nullfs_range *r = set->last, *next;
+
+  if (!r || r->start > start || r->end < start)
+    r = nullfs_range_lookup(set, start);
+  if (r && r->end >= start) {
+    if (r->end >= end) {
+      set->last = r;
+      return true;
+    }
+    set->bytes += end - r->end;
+    r->end = end;
+  } else {
+    r = nullfs_range_spare(spares);
+    if (!r)
+      return false;
+    r->start = start;
+    r->end = end;
+    nullfs_range_insert(set, r);
+    set->bytes += end - start;
+  }
+
+  /* swallow ranges which now overlap or touch */
+  while ((next = nullfs_range_next(r)) && next->start <= r->end) {
+    set->bytes -= min(next->end, r->end) - next->start;
+    r->end = max(r->end, next->end);
+    nullfs_range_erase(set, next);
+  }
+  set->last = r;
+  return true;
+}
+
+/* remove [start, end) from the set, false if a spare node is needed */
+static bool nullfs_range_remove(struct nullfs_rangeset *set, loff_t start,
+                                loff_t end, struct nullfs_range **spares) {
+  struct nullfs_range *r = nullfs_range_lookup(set, start), *next;
+
+  if (r && r->start < start && r->end > end) {
+    /* punching into the middle of a range splits it */
+    next = nullfs_range_spare(spares);
+    if (!next)
+      return false;
+    next->start = end;
+    next->end = r->end;
+    r->end = start;
+    nullfs_range_insert(set, next);
+    set->bytes -= end - start;
+    return true;
+  }
+  if (r && r->start < start) {
+    if (r->end > start) {
+      set->bytes -= r->end - start;
+      r->end = start;
+    }
+    r = nullfs_range_next(r);
+  } else if (!r) {
+    r = nullfs_range_first(set);
+  }
+
+  while (r && r->start < end) {
+    next = nullfs_range_next(r);
+    if (r->end > end) {
+      set->bytes -= end - r->start;
+      r->start = end;
+      break;
+    }
+    set->bytes -= r->end - r->start;
+    nullfs_range_erase(set, r);
+    r = next;
+  }
+  return true;
+}
+
+/* move everything behind end down to start, [start, end) must be empty */
+static void nullfs_range_shift(struct nullfs_rangeset *set, loff_t start,
+                               loff_t end) {
+  struct nullfs_range *r = nullfs_range_lookup(set, start), *next;
+  struct nullfs_range *prev = r;
+
+  r = r ? nullfs_range_next(r) : nullfs_range_first(set);
+  for (; r; r = nullfs_range_next(r)) {
+    r->start -= end - start;
+    r->end -= end - start;
+  }
+  if (prev && (next = nullfs_range_next(prev)) && next->start == prev->end) {
+    prev->end = next->end;
+    nullfs_range_erase(set, next);
+  }
+  set->last = NULL;
+}
+
+static void nullfs_range_destroy(struct nullfs_rangeset *set) {
+  struct nullfs_range *r, *tmp;
+
+  rbtree_postorder_for_each_entry_safe(r, tmp, &set->root, node)
+      kfree(r);
+  set->root = RB_ROOT;
+  set->last = NULL;
+  set->bytes = 0;
+}
+
+static bool nullfs_extents_apply(struct nullfs_extents *ext, int op,
+                                 loff_t start, loff_t end,
+                                 struct nullfs_range **spares) {
+  switch (op) {
+  case NULLFS_EXT_WRITE:
+    return nullfs_range_add(&ext->data, start, end, spares) &&
+           nullfs_range_add(&ext->alloc, start, end, spares);
+  case NULLFS_EXT_ALLOC:
+    return nullfs_range_add(&ext->alloc, start, end, spares);
+  case NULLFS_EXT_ZERO:
+    return nullfs_range_remove(&ext->data, start, end, spares) &&
+           nullfs_range_add(&ext->alloc, start, end, spares);
+  case NULLFS_EXT_PUNCH:
+    return nullfs_range_remove(&ext->data, start, end, spares) &&
+           nullfs_range_remove(&ext->alloc, start, end, spares);
+  case NULLFS_EXT_COLLAPSE:
+    if (!nullfs_range_remove(&ext->data, start, end, spares) ||
+        !nullfs_range_remove(&ext->alloc, start, end, spares))
+      return false;
+    nullfs_range_shift(&ext->data, start, end);
+    nullfs_range_shift(&ext->alloc, start, end);
+    return true;
+  }
+  return true;
+}
+
+static struct nullfs_extents *nullfs_extents(struct inode *inode) {
+  struct nullfs_file_ext *ext = nullfs_file_ext(inode);
+
+  return ext ? READ_ONCE(ext->extents) : NULL;
+}
+
+static bool nullfs_sparse(struct inode *inode) {
+  struct nullfs_fs_info *fsi = inode->i_sb->s_fs_info;
+
+  return fsi->mount_opts.sparse;
+}
+
+/**
+ * IOCB_NOWAIT requests allocate with GFP_NOWAIT, a failed allocation
+ * sends them back to be retried from a worker thread
+ **/
+static int nullfs_nomem(gfp_t gfp) {
+  return gfp == GFP_NOWAIT ? -EAGAIN : -ENOMEM;
+}
+
+static int nullfs_extents_update(struct inode *inode, int op, loff_t start,
+                                 loff_t end, gfp_t gfp) {
+  struct nullfs_range *spares[NULLFS_EXT_SPARES] = {NULL};
+  struct nullfs_extents *ext = nullfs_extents(inode), *new;
+  struct nullfs_file_ext *fe;
+  int i, err = 0;
+  bool done;
+
+  if (start >= end)
+    return 0;
+  if (!ext) {
+    if (op == NULLFS_EXT_PUNCH || op == NULLFS_EXT_COLLAPSE)
+      return 0;
+    fe = nullfs_file_ext_get(inode, gfp);
+    if (!fe)
+      return nullfs_nomem(gfp);
+    new = kzalloc(sizeof(*new), gfp);
+    if (!new)
+      return nullfs_nomem(gfp);
+    spin_lock_init(&new->lock);
+    new->data.root = RB_ROOT;
+    new->alloc.root = RB_ROOT;
+    ext = cmpxchg(&fe->extents, NULL, new);
+    if (ext)
+      kfree(new);
+    else
+      ext = new;
+  }
+
+  for (;;) {
+    spin_lock(&ext->lock);
+    done = nullfs_extents_apply(ext, op, start, end, spares);
+    spin_unlock(&ext->lock);
+    if (done)
+      break;
+    for (i = 0; i < NULLFS_EXT_SPARES; i++) {
+      if (!spares[i])
+        spares[i] = kmalloc(sizeof(struct nullfs_range), gfp);
+      if (!spares[i]) {
+        err = nullfs_nomem(gfp);
+        goto out;
+      }
+    }
+  }
+out:
+  for (i = 0; i < NULLFS_EXT_SPARES; i++)
+    kfree(spares[i]);
+  return err;
+}
+
+static void nullfs_extents_free(struct inode *inode) {
+  struct nullfs_extents *ext = nullfs_extents(inode);
+
+  if (!ext)
+    return;
+  nullfs_range_destroy(&ext->data);
+  nullfs_range_destroy(&ext->alloc);
+  kfree(ext);
+  nullfs_file_ext(inode)->extents = NULL;
+}
+
+/* allocated bytes of a sparse file, for st_blocks */
+static u64 nullfs_extents_bytes(struct inode *inode) {
+  struct nullfs_extents *ext = nullfs_extents(inode);
+  u64 bytes;
+
+  if (!ext)
+    return 0;
+  spin_lock(&ext->lock);
+  bytes = ext->alloc.bytes;
+  spin_unlock(&ext->lock);
+  return bytes;
+}
+
+extern const struct file_operations nullfs_file_operations;
+
+/**
+ * regular filesystem handlers, inode handling etc..
+ **/
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+static int nullfs_getattr(struct mnt_idmap *idmap, const struct path *path,
+                          struct kstat *stat, u32 request_mask,
+                          unsigned int flags) {
+  struct inode *inode = path->dentry->d_inode;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+static int nullfs_getattr(struct user_namespace *mnt_userns,
+                          const struct path *path, struct kstat *stat,
+                          u32 request_mask, unsigned int flags) {
+  struct inode *inode = path->dentry->d_inode;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+static int nullfs_getattr(const struct path *path, struct kstat *stat,
+                          u32 request_mask, unsigned int flags) {
+  struct inode *inode = path->dentry->d_inode;
+#else
+static int nullfs_getattr(struct vfsmount *mnt, struct dentry *dentry,
+                          struct kstat *stat) {
+  struct inode *inode = dentry->d_inode;
+#endif
+
+  u64 start = nullfs_lat_start(inode->i_sb);
+  unsigned long npages;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+  generic_fillattr(&nop_mnt_idmap, request_mask, inode, stat);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+  generic_fillattr(&nop_mnt_idmap, inode, stat);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+  generic_fillattr(&init_user_ns, inode, stat);
+#else
+  generic_fillattr(inode, stat);
+#endif
+  npages = (inode->i_size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+  stat->blocks = npages << (PAGE_SHIFT - 9);
+  if (S_ISREG(inode->i_mode) && nullfs_sparse(inode) &&
+      inode->i_fop == &nullfs_file_operations)
+    stat->blocks = DIV_ROUND_UP_ULL(nullfs_extents_bytes(inode), 512);
+#ifdef STATX_DIOALIGN
+  if ((request_mask & STATX_DIOALIGN) && S_ISREG(inode->i_mode) &&
+      inode->i_fop == &nullfs_file_operations) {
+    struct nullfs_fs_info *fsi = inode->i_sb->s_fs_info;
+
+    stat->dio_mem_align = fsi->mount_opts.dio_align;
+    stat->dio_offset_align = fsi->mount_opts.dio_align;
+    stat->result_mask |= STATX_DIOALIGN;
+  }
+#endif
+  nullfs_lat_end(inode->i_sb, NULLFS_LAT_GETATTR, start);
+  return 0;
+}
+
+/**
+ * Capacity accounting
+ *
+ * The logical size of all regular files is summed up per superblock for
+ * statfs. Every file remembers the size it has accounted, whoever
+ * changes i_size syncs that with a single xchg, so the counter never
+ * drifts even if writers and truncate race. With the enforce option the
+ * size= and nr_inodes= limits fail with ENOSPC the way tmpfs does,
+ * otherwise they are only reported.
+ **/
+static void nullfs_size_sync(struct inode *inode) {
+  struct nullfs_fs_info *fsi = inode->i_sb->s_fs_info;
+  s64 size = i_size_read(inode);
+
+  size -= atomic64_xchg(&NULLFS_I(inode)->file.accounted, size);
+  if (size)
+    percpu_counter_add(&fsi->bytes, size);
+}
+
+static bool nullfs_over_size(struct inode *inode, loff_t grow) {
+  struct nullfs_fs_info *fsi = inode->i_sb->s_fs_info;
+  u64 max = fsi->mount_opts.size;
+
+  if (!fsi->mount_opts.enforce || !max || grow <= 0)
+    return false;
+  return grow > max || percpu_counter_compare(&fsi->bytes, max - grow) > 0;
+}
+
+static bool nullfs_over_inodes(struct nullfs_fs_info *fsi) {
+  u64 max = fsi->mount_opts.nr_inodes;
+
+  if (!fsi->mount_opts.enforce || !max)
+    return false;
+  return percpu_counter_compare(&fsi->inodes, max) >= 0;
+}
+
+/**
+ * Size handling for nulled files.
+ *
+ * Writers never take the inode lock: the size is raised to the end of
+ * the written range with a cmpxchg loop, so any number of threads can
+ * write or append to the same file. Appending writers reserve their
+ * range with the same loop. On 32 bit kernels i_size is protected by a
+ * seqcount, fall back to the inode lock there. The size before the
+ * write is returned in prev, so a write which fails later on can take
+ * its growth back with nullfs_undo_grow().
+ **/
+VISIBLE_IF_KUNIT ssize_t nullfs_grow_size(struct inode *inode, loff_t *pos,
+                                          size_t count, bool append,
+                                          loff_t *prev) {
+  loff_t maxbytes = inode->i_sb->s_maxbytes;
+  loff_t start, old, new;
+
+  *prev = i_size_read(inode);
+  if (!count)
+    return 0;
+
+#if BITS_PER_LONG == 64
+  old = READ_ONCE(inode->i_size);
+  for (;;) {
+    loff_t cur;
+
+    start = append ? old : *pos;
+    if (start >= maxbytes)
+      return -EFBIG;
+    count = min_t(loff_t, count, maxbytes - start);
+    new = max_t(loff_t, old, start + count);
+    if (new == old)
+      break;
+    if (nullfs_over_size(inode, new - old))
+      return -ENOSPC;
+    cur = cmpxchg(&inode->i_size, old, new);
+    if (cur == old)
+      break;
+    old = cur;
+  }
+#else
+  inode_lock(inode);
+  old = i_size_read(inode);
+  start = append ? old : *pos;
+  if (start >= maxbytes) {
+    inode_unlock(inode);
+    return -EFBIG;
+  }
+  count = min_t(loff_t, count, maxbytes - start);
+  new = max_t(loff_t, old, start + count);
+  if (nullfs_over_size(inode, new - old)) {
+    inode_unlock(inode);
+    return -ENOSPC;
+  }
+  if (new != old)
+    i_size_write(inode, new);
+  inode_unlock(inode);
+#endif
+
+  *prev = old;
+  if (new != old)
+    nullfs_size_sync(inode);
+  *pos = start + count;
+  return count;
+}
+EXPORT_SYMBOL_IF_KUNIT(nullfs_grow_size);
+
+/* shrink back from new to old, unless the file has grown further since */
+static void nullfs_undo_grow(struct inode *inode, loff_t old, loff_t new) {
+  if (old >= new)
+    return;
+#if BITS_PER_LONG == 64
+  if (cmpxchg(&inode->i_size, new, old) != new)
+    return;
+#else
+  inode_lock(inode);
+  if (i_size_read(inode) != new) {
+    inode_unlock(inode);
+    return;
+  }
+  i_size_write(inode, old);
+  inode_unlock(inode);
+#endif
+  nullfs_size_sync(inode);
+}
+
+static ssize_t nullfs_account_write(struct inode *inode, loff_t *pos,
+                                    size_t count, bool append, gfp_t gfp) {
+  loff_t old;
+  ssize_t ret = nullfs_grow_size(inode, pos, count, append, &old);
+  int err;
+
+  if (ret > 0 && nullfs_sparse(inode)) {
+    err = nullfs_extents_update(inode, NULLFS_EXT_WRITE, *pos - ret, *pos,
+                                gfp);
+    if (err) {
+      /* the write fails, so it must not leave the file grown */
+      nullfs_undo_grow(inode, old, *pos);
+      *pos -= ret;
+      return err;
+    }
+  }
+  return ret;
+}
+
+VISIBLE_IF_KUNIT size_t nullfs_read_count(struct inode *inode, loff_t pos,
+                                          size_t count) {
+  loff_t isize = i_size_read(inode);
+
+  if (pos >= isize)
+    return 0;
+  return min_t(loff_t, count, isize - pos);
+}
+EXPORT_SYMBOL_IF_KUNIT(nullfs_read_count);
+
+/**
+ * Checksum on write
+ *
+ * With checksum= set, the data written to nulled files is run through
+ * crc32c or xxhash64 before it is dropped. Only the digest state and the
+ * number of bytes hashed are kept per file, allocated on the first write.
+ * Writes are hashed in the order they complete; to get the digest of the
+ * file content, write it sequentially. The result can be read via the
+ * user.nullfs.checksum xattr, truncating a file to zero starts over.
+ **/
+struct nullfs_csum {
+  u64 len;
+  union {
+    u32 crc;
+#if IS_ENABLED(CONFIG_XXHASH)
+    struct xxh64_state xxh;
+#endif
+  };
+};
+
+static bool nullfs_csum_enabled(struct inode *inode) {
+  struct nullfs_fs_info *fsi = inode->i_sb->s_fs_info;
+
+  return fsi->mount_opts.checksum != NULLFS_CSUM_NONE;
+}
+
+static void nullfs_csum_reset(struct nullfs_fs_info *fsi,
+                              struct nullfs_csum *c) {
+  c->len = 0;
+  switch (fsi->mount_opts.checksum) {
+  case NULLFS_CSUM_CRC32C:
+    c->crc = ~0;
+    break;
+#if IS_ENABLED(CONFIG_XXHASH)
+  case NULLFS_CSUM_XXHASH64:
+    xxh64_reset(&c->xxh, 0);
+    break;
+#endif
+  }
+}
+
+static void nullfs_csum_update(struct nullfs_fs_info *fsi,
+                               struct nullfs_csum *c, const void *buf,
+                               size_t len) {
+  switch (fsi->mount_opts.checksum) {
+  case NULLFS_CSUM_CRC32C:
+#if NULLFS_HAVE_CRC32C
+    c->crc = crc32c(c->crc, buf, len);
+#endif
+    break;
+#if IS_ENABLED(CONFIG_XXHASH)
+  case NULLFS_CSUM_XXHASH64:
+    xxh64_update(&c->xxh, buf, len);
+    break;
+#endif
+  }
+  c->len += len;
+}
+
+/* called with the inode lock held */
+static struct nullfs_csum *nullfs_csum_get(struct inode *inode) {
+  struct nullfs_file_ext *ext = nullfs_file_ext_get(inode, GFP_KERNEL);
+
+  if (!ext)
+    return NULL;
+  if (!ext->csum) {
+    ext->csum = kmalloc(sizeof(*ext->csum), GFP_KERNEL);
+    if (ext->csum)
+      nullfs_csum_reset(inode->i_sb->s_fs_info, ext->csum);
+  }
+  return ext->csum;
+}
+
+/**
+ * consume a write of len bytes to a nulled file, either from a plain user
+ * buffer or an iov_iter. Without checksum only the size is accounted.
+ * Otherwise the data is bounced through a page a chunk at a time and only
+ * what could be copied and accounted is hashed, so size, position and
+ * digest agree if the copy faults or the file system is full.
+ **/
+static ssize_t nullfs_write_data(struct inode *inode, const char __user *ubuf,
+                                 struct iov_iter *from, loff_t *pos,
+                                 size_t len, bool append, gfp_t gfp) {
+  struct nullfs_fs_info *fsi = inode->i_sb->s_fs_info;
+  struct nullfs_csum *c;
+  size_t done = 0, n;
+  ssize_t ret = 0;
+  void *page;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 18, 0)
+  if (!nullfs_csum_enabled(inode)) {
+#else
+  if (!nullfs_csum_enabled(inode) || from) {
+#endif
+    ret = nullfs_account_write(inode, pos, len, append, gfp);
+    if (ret > 0 && from)
+      iov_iter_advance(from, ret);
+    return ret;
+  }
+
+  page = (void *)__get_free_page(GFP_KERNEL);
+  if (!page)
+    return -ENOMEM;
+  /* allocate the digest up front, a truncate to zero may drop it again */
+  inode_lock(inode);
+  c = nullfs_csum_get(inode);
+  inode_unlock(inode);
+  if (!c)
+    ret = -ENOMEM;
+
+  while (c && done < len) {
+    n = min_t(size_t, len - done, PAGE_SIZE);
+    if (!from)
+      n = copy_from_user(page, ubuf + done, n) ? 0 : n;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 18, 0)
+    else
+      n = copy_from_iter(page, n, from);
+#endif
+    if (!n) {
+      ret = -EFAULT;
+      break;
+    }
+    ret = nullfs_account_write(inode, pos, n, append, gfp);
+    if (ret <= 0) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+      if (from)
+        iov_iter_revert(from, n);
+#endif
+      break;
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+    if (from && ret < n)
+      iov_iter_revert(from, n - ret);
+#endif
+    inode_lock(inode);
+    c = nullfs_csum_get(inode);
+    if (c)
+      nullfs_csum_update(fsi, c, page, ret);
+    inode_unlock(inode);
+    done += ret;
+    if (ret < n)
+      break;
+  }
+
+  free_page((unsigned long)page);
+  return done ? done : ret;
+}
+
+static void nullfs_csum_page(struct inode *inode, struct page *page,
+                             unsigned int offset, size_t len) {
+  struct nullfs_csum *c;
+  void *addr;
+
+  inode_lock(inode);
+  c = nullfs_csum_get(inode);
+  if (c) {
+    addr = kmap(page);
+    nullfs_csum_update(inode->i_sb->s_fs_info, c, addr + offset, len);
+    kunmap(page);
+  }
+  inode_unlock(inode);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+static int nullfs_csum_xattr_get(const struct xattr_handler *handler,
+                                 struct dentry *dentry, struct inode *inode,
+                                 const char *name, void *buffer,
+                                 size_t size) {
+  struct nullfs_fs_info *fsi = inode->i_sb->s_fs_info;
+  struct nullfs_csum c, *cur;
+  char value[64];
+  int len = 0;
+
+  if (!nullfs_csum_enabled(inode) || !S_ISREG(inode->i_mode))
+    return -ENODATA;
+
+  inode_lock(inode);
+  cur = nullfs_file_ext(inode) ? nullfs_file_ext(inode)->csum : NULL;
+  if (cur)
+    c = *cur;
+  else
+    nullfs_csum_reset(fsi, &c);
+  inode_unlock(inode);
+
+  switch (fsi->mount_opts.checksum) {
+  case NULLFS_CSUM_CRC32C:
+    len = snprintf(value, sizeof(value), "crc32c:%08x:%llu", ~c.crc, c.len);
+    break;
+#if IS_ENABLED(CONFIG_XXHASH)
+  case NULLFS_CSUM_XXHASH64:
+    len = snprintf(value, sizeof(value), "xxhash64:%016llx:%llu",
+                   xxh64_digest(&c.xxh), c.len);
+    break;
+#endif
+  }
+  if (!size)
+    return len;
+  if (size < len)
+    return -ERANGE;
+  memcpy(buffer, value, len);
+  return len;
+}
+
+static const struct xattr_handler nullfs_csum_xattr_handler = {
+    .name = NULLFS_XATTR_CHECKSUM,
+    .get = nullfs_csum_xattr_get,
+};
+#endif
+
+/**
+ * Read patterns
+ *
+ * By default reads from nulled files return without touching the
+ * buffer. pattern=zero copies out real zeros, pattern=prng and
+ * pattern=text reproducible data which is derived from the inode number
+ * and the offset, so the same read always returns the same bytes while
+ * compression and deduplication see realistic input.
+ *
+ * Both are built from a pool of precomputed data: every 4k block of a
+ * file picks a slice of the pool by a hash of (inode, block), prng data
+ * is additionally xored with that hash so no two blocks are the same.
+ **/
+#define NULLFS_PATTERN_SHIFT 12
+#define NULLFS_PATTERN_BLOCK (1 << NULLFS_PATTERN_SHIFT)
+#define NULLFS_POOL_SIZE (64 * 1024)
+#define NULLFS_POOL_BLOCKS (NULLFS_POOL_SIZE / NULLFS_PATTERN_BLOCK)
+
+static u64 *nullfs_prng_pool;
+static char *nullfs_text_pool;
+
+static inline u64 nullfs_mix64(u64 x) {
+  /* splitmix64 finalizer */
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+static int nullfs_pattern_init(void) {
+  static const char *const words[] = {
+      "the",    "of",     "and",   "to",     "in",      "is",    "that",
+      "for",    "it",     "as",    "was",    "with",    "be",    "by",
+      "on",     "not",    "he",    "this",   "are",     "or",    "his",
+      "from",   "at",     "which", "but",    "have",    "an",    "had",
+      "they",   "you",    "were",  "their",  "one",     "all",   "we",
+      "can",    "her",    "has",   "there",  "been",    "if",    "more",
+      "when",   "will",   "would", "who",    "so",      "no",    "data",
+      "file",   "system", "block", "backup", "restore", "write", "read",
+      "server", "disk",   "time",  "value",  "error",   "null",  "void",
+      "kernel"};
+  u64 seed = 0x6e756c6c667376ULL;
+  unsigned int i, col = 0;
+  const char *w;
+  size_t len;
+
+  nullfs_prng_pool = vmalloc(NULLFS_POOL_SIZE);
+  nullfs_text_pool = vmalloc(NULLFS_POOL_SIZE);
+  if (!nullfs_prng_pool || !nullfs_text_pool) {
+    vfree(nullfs_prng_pool);
+    vfree(nullfs_text_pool);
+    return -ENOMEM;
+  }
+
+  for (i = 0; i < NULLFS_POOL_SIZE / sizeof(u64); i++)
+    nullfs_prng_pool[i] = nullfs_mix64(seed += 0x9e3779b97f4a7c15ULL);
+
+  for (i = 0; i < NULLFS_POOL_SIZE;) {
+    w = words[(u32)nullfs_mix64(seed += 0x9e3779b97f4a7c15ULL) %
+              ARRAY_SIZE(words)];
+    len = min_t(size_t, strlen(w), NULLFS_POOL_SIZE - i);
+    memcpy(nullfs_text_pool + i, w, len);
+    i += len;
+    col += len;
+    if (i < NULLFS_POOL_SIZE)
+      nullfs_text_pool[i++] = col > 72 ? '\n' : ' ';
+    if (col > 72)
+      col = 0;
+  }
+  return 0;
+}
+
+static void nullfs_pattern_exit(void) {
+  vfree(nullfs_prng_pool);
+  vfree(nullfs_text_pool);
+}
+
+static void nullfs_pattern_block(int pattern, u64 ino, u64 block, void *dst) {
+  u64 key = nullfs_mix64(ino ^ nullfs_mix64(block));
+  const u64 *src;
+  u64 *d = dst;
+  unsigned int i;
+
+  if (pattern == NULLFS_PATTERN_ZERO) {
+    memset(dst, 0, NULLFS_PATTERN_BLOCK);
+    return;
+  }
+  if (pattern == NULLFS_PATTERN_TEXT) {
+    memcpy(dst,
+           nullfs_text_pool +
+               (u32)key % (NULLFS_POOL_SIZE - NULLFS_PATTERN_BLOCK),
+           NULLFS_PATTERN_BLOCK);
+    return;
+  }
+  src = nullfs_prng_pool +
+        ((u32)key % NULLFS_POOL_BLOCKS) * (NULLFS_PATTERN_BLOCK / sizeof(u64));
+  for (i = 0; i < NULLFS_PATTERN_BLOCK / sizeof(u64); i++)
+    d[i] = src[i] ^ key;
+}
+
+static int nullfs_pattern_mode(struct inode *inode) {
+  struct nullfs_fs_info *fsi = inode->i_sb->s_fs_info;
+
+  return fsi->mount_opts.pattern;
+}
+
+/**
+ * copy len bytes of the pattern at pos either to a plain user buffer
+ * or an iov_iter, returns the number of bytes copied
+ **/
+static ssize_t nullfs_pattern_read(struct inode *inode, char __user *ubuf,
+                                   struct iov_iter *to, loff_t pos,
+                                   size_t len, gfp_t gfp) {
+  int pattern = nullfs_pattern_mode(inode);
+  size_t done = 0, n, copied;
+  unsigned int off;
+  void *page;
+
+  if (pattern == NULLFS_PATTERN_ZERO) {
+    if (!to)
+      return len - clear_user(ubuf, len);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 18, 0)
+    return iov_iter_zero(len, to);
+#endif
+  }
+
+  page = (void *)__get_free_page(gfp);
+  if (!page)
+    return nullfs_nomem(gfp);
+  while (done < len) {
+    off = (pos + done) & (NULLFS_PATTERN_BLOCK - 1);
+    n = min_t(size_t, len - done, NULLFS_PATTERN_BLOCK - off);
+    nullfs_pattern_block(pattern, inode->i_ino,
+                         (pos + done) >> NULLFS_PATTERN_SHIFT, page);
+    if (!to)
+      copied = copy_to_user(ubuf + done, page + off, n) ? 0 : n;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 18, 0)
+    else
+      copied = copy_to_iter(page + off, n, to);
+#endif
+    done += copied;
+    if (copied < n)
+      break;
+  }
+  free_page((unsigned long)page);
+  return done;
+}
+
+/**
+ * O_DIRECT
+ *
+ * Nulled files never touch the page cache, so direct I/O takes the same
+ * path as buffered I/O and completes synchronously. Like a disk with a
+ * logical block size of dio_align, the file offset, the length and the
+ * buffer address have to be aligned, otherwise the request fails with
+ * EINVAL before anything is accounted.
+ **/
+static bool nullfs_dio_aligned(struct inode *inode, loff_t pos,
+                               unsigned long bits) {
+  struct nullfs_fs_info *fsi = inode->i_sb->s_fs_info;
+
+  return !(((unsigned long)pos | bits) & (fsi->mount_opts.dio_align - 1));
+}
+
+static bool nullfs_dio_misaligned(struct file *filp, const void *buf,
+                                  size_t count, loff_t pos) {
+  if (!(filp->f_flags & O_DIRECT))
+    return false;
+  return !nullfs_dio_aligned(file_inode(filp), pos,
+                             (unsigned long)buf | count);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+static bool nullfs_dio_misaligned_iter(struct kiocb *iocb,
+                                       struct iov_iter *iter) {
+  if (!(iocb->ki_flags & IOCB_DIRECT))
+    return false;
+  return !nullfs_dio_aligned(file_inode(iocb->ki_filp), iocb->ki_pos,
+                             iov_iter_alignment(iter));
+}
+#else
+static bool nullfs_dio_misaligned_iter(struct kiocb *iocb,
+                                       struct iov_iter *iter) {
+  return false;
+}
+#endif
+
+static int nullfs_open(struct inode *inode, struct file *filp) {
+#ifdef FMODE_CAN_ODIRECT
+  filp->f_mode |= FMODE_CAN_ODIRECT;
+#endif
+#ifdef FMODE_NOWAIT
+  filp->f_mode |= FMODE_NOWAIT;
+#endif
+  return 0;
+}
+
+/**
+ * IOCB_NOWAIT, io_uring and aio submit with it and only punt the request
+ * to a worker thread if it fails with EAGAIN. Nulled I/O only sleeps if
+ * it is throttled, for the inode lock while hashing written data and
+ * for the per file stats allocated on the first I/O. The extents of
+ * sparse files and the pattern page are allocated with GFP_NOWAIT.
+ **/
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+static bool nullfs_nowait_block(struct kiocb *iocb, size_t bytes,
+                                bool write) {
+  struct inode *inode = file_inode(iocb->ki_filp);
+  struct nullfs_fs_info *fsi = inode->i_sb->s_fs_info;
+  struct nullfs_file_ext *ext = nullfs_file_ext(inode);
+
+  if (!(iocb->ki_flags & IOCB_NOWAIT))
+    return false;
+  if (write && nullfs_csum_enabled(inode))
+    return true;
+  if (fsi->mount_opts.stats && !(ext && READ_ONCE(ext->stats)))
+    return true;
+  return nullfs_would_block(inode, bytes);
+}
+
+static gfp_t nullfs_iocb_gfp(struct kiocb *iocb) {
+  return iocb->ki_flags & IOCB_NOWAIT ? GFP_NOWAIT : GFP_KERNEL;
+}
+#else
+static bool nullfs_nowait_block(struct kiocb *iocb, size_t bytes,
+                                bool write) {
+  return false;
+}
+
+static gfp_t nullfs_iocb_gfp(struct kiocb *iocb) { return GFP_KERNEL; }
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+/**
+ * IORING_SETUP_IOPOLL insists on an iopoll handler, all requests have
+ * completed by the time they are polled for
+ **/
+static int nullfs_iopoll(struct kiocb *iocb, struct io_comp_batch *iob,
+                         unsigned int flags) {
+  return 0;
+}
+#endif
+
+static ssize_t write_null(struct file *filp, const char *buf, size_t count,
+                          loff_t *offset) {
+  /**
+   * keep track of size
+   **/
+  u64 start = nullfs_lat_start(file_inode(filp)->i_sb);
+  ssize_t ret;
+
+  if (nullfs_dio_misaligned(filp, buf, count, *offset))
+    return -EINVAL;
+  ret = nullfs_throttle(file_inode(filp), count);
+  if (ret)
+    return ret;
+  ret = nullfs_write_data(file_inode(filp), buf, NULL, offset, count,
+                          filp->f_flags & O_APPEND, GFP_KERNEL);
+  trace_nullfs_write(file_inode(filp), ret > 0 ? *offset - ret : *offset,
+                     count, ret, false);
+  nullfs_stats_io(filp, true, ret);
+  nullfs_lat_end(file_inode(filp)->i_sb, NULLFS_LAT_WRITE, start);
+  return ret;
+}
+
+static ssize_t read_null(struct file *filp, char *buf, size_t count,
+                         loff_t *offset) {
+
+  /**
+   * Pretend we have returned some data
+   * during file read
+   **/
+  struct inode *inode = file_inode(filp);
+  u64 start = nullfs_lat_start(inode->i_sb);
+  size_t nbytes;
+
+  if (nullfs_dio_misaligned(filp, buf, count, *offset))
+    return -EINVAL;
+  nbytes = nullfs_read_count(inode, *offset, count);
+  if (nullfs_throttle(inode, nbytes))
+    return -EINTR;
+  if (nbytes && nullfs_pattern_mode(inode) != NULLFS_PATTERN_NONE) {
+    ssize_t ret =
+        nullfs_pattern_read(inode, buf, NULL, *offset, nbytes, GFP_KERNEL);
+
+    if (ret <= 0)
+      return ret ? ret : -EFAULT;
+    nbytes = ret;
+  }
+  trace_nullfs_read(inode, *offset, count, nbytes, false);
+  nullfs_stats_io(filp, false, nbytes);
+  *offset += nbytes;
+  nullfs_lat_end(inode->i_sb, NULLFS_LAT_READ, start);
+  return nbytes;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+static ssize_t write_iter_null(struct kiocb *iocb, struct iov_iter *from) {
+  /**
+   * consume the complete iov_iter in one go, writev, aio and
+   * io_uring submissions end up here
+   **/
+  u64 start = nullfs_lat_start(file_inode(iocb->ki_filp)->i_sb);
+  size_t count = iov_iter_count(from);
+  ssize_t ret;
+
+  if (nullfs_dio_misaligned_iter(iocb, from))
+    return -EINVAL;
+  if (nullfs_nowait_block(iocb, iov_iter_count(from), true))
+    return -EAGAIN;
+  ret = nullfs_throttle(file_inode(iocb->ki_filp), iov_iter_count(from));
+  if (ret)
+    return ret;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+  ret = nullfs_write_data(file_inode(iocb->ki_filp), NULL, from,
+                          &iocb->ki_pos, count, iocb->ki_flags & IOCB_APPEND,
+                          nullfs_iocb_gfp(iocb));
+#else
+  ret = nullfs_write_data(file_inode(iocb->ki_filp), NULL, from,
+                          &iocb->ki_pos, count,
+                          iocb->ki_filp->f_flags & O_APPEND, GFP_KERNEL);
+#endif
+  trace_nullfs_write(file_inode(iocb->ki_filp),
+                     ret > 0 ? iocb->ki_pos - ret : iocb->ki_pos, count, ret,
+                     false);
+  nullfs_stats_io(iocb->ki_filp, true, ret);
+  nullfs_lat_end(file_inode(iocb->ki_filp)->i_sb, NULLFS_LAT_WRITE, start);
+  return ret;
+}
+
+static ssize_t read_iter_null(struct kiocb *iocb, struct iov_iter *to) {
+  /**
+   * Same as read_null: pretend the data has been
+   * copied, skip over all segments
+   **/
+  struct inode *inode = file_inode(iocb->ki_filp);
+  u64 start = nullfs_lat_start(inode->i_sb);
+  size_t count = iov_iter_count(to);
+  size_t nbytes;
+
+  if (nullfs_dio_misaligned_iter(iocb, to))
+    return -EINVAL;
+  nbytes = nullfs_read_count(inode, iocb->ki_pos, count);
+  if (nullfs_nowait_block(iocb, nbytes, false))
+    return -EAGAIN;
+  if (nullfs_throttle(inode, nbytes))
+    return -EINTR;
+  if (nbytes && nullfs_pattern_mode(inode) != NULLFS_PATTERN_NONE) {
+    ssize_t ret = nullfs_pattern_read(inode, NULL, to, iocb->ki_pos, nbytes,
+                                      nullfs_iocb_gfp(iocb));
+
+    if (ret <= 0)
+      return ret ? ret : -EFAULT;
+    nbytes = ret;
+  } else {
+    iov_iter_advance(to, nbytes);
+  }
+  trace_nullfs_read(inode, iocb->ki_pos, count, nbytes, false);
+  nullfs_stats_io(iocb->ki_filp, false, nbytes);
+  iocb->ki_pos += nbytes;
+  nullfs_lat_end(inode->i_sb, NULLFS_LAT_READ, start);
+  return nbytes;
+}
+#endif
+
+/**
+ * account every pipe buffer before it is hashed, so a buffer which does
+ * not fit any more ends the splice without ending up in the digest
+ **/
+static int pipe_to_null(struct pipe_inode_info *pipe, struct pipe_buffer *buf,
+                        struct splice_desc *sd) {
+  struct inode *inode = file_inode(sd->u.file);
+  loff_t pos = sd->pos;
+  ssize_t ret;
+
+  ret = nullfs_account_write(inode, &pos, sd->len,
+                             sd->u.file->f_flags & O_APPEND, GFP_KERNEL);
+  if (ret > 0 && nullfs_csum_enabled(inode))
+    nullfs_csum_page(inode, buf->page, buf->offset, ret);
+  return ret;
+}
+
+static ssize_t splice_write_null(struct pipe_inode_info *pipe, struct file *out,
+                                 loff_t *ppos, size_t len, unsigned int flags) {
+  /**
+   * drop the pipe buffers in place, only the size is kept
+   **/
+  u64 start = nullfs_lat_start(file_inode(out)->i_sb);
+  ssize_t ret;
+  int err;
+
+  ret = splice_from_pipe(pipe, out, ppos, len, flags, pipe_to_null);
+  /**
+   * only now is known how much the pipe held. The data stays accounted,
+   * but a task killed while throttled sees -EINTR like with write()
+   **/
+  if (ret > 0) {
+    err = nullfs_throttle(file_inode(out), ret);
+    if (err)
+      ret = err;
+  }
+  nullfs_lat_end(file_inode(out)->i_sb, NULLFS_LAT_WRITE, start);
+  return ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+/**
+ * pipe buffers handed out by splice_read_null all point to the
+ * shared zero page, which is never freed nor stolen.
+ **/
+static void zero_pipe_buf_release(struct pipe_inode_info *pipe,
+                                  struct pipe_buffer *buf) {}
+
+static bool zero_pipe_buf_try_steal(struct pipe_inode_info *pipe,
+                                    struct pipe_buffer *buf) {
+  return false;
+}
+
+static bool zero_pipe_buf_get(struct pipe_inode_info *pipe,
+                              struct pipe_buffer *buf) {
+  return true;
+}
+
+static const struct pipe_buf_operations nullfs_zero_pipe_buf_ops = {
+    .release = zero_pipe_buf_release,
+    .try_steal = zero_pipe_buf_try_steal,
+    .get = zero_pipe_buf_get,
+};
+
+static ssize_t splice_read_null(struct file *in, loff_t *ppos,
+                                struct pipe_inode_info *pipe, size_t len,
+                                unsigned int flags) {
+  ssize_t total = 0;
+
+  /* zero pages can only stand in for zeros, copy everything else */
+  if (nullfs_pattern_mode(file_inode(in)) > NULLFS_PATTERN_ZERO)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    return copy_splice_read(in, ppos, pipe, len, flags);
+#else
+    return generic_file_splice_read(in, ppos, pipe, len, flags);
+#endif
+
+  len = nullfs_read_count(file_inode(in), *ppos, len);
+  if (nullfs_throttle(file_inode(in), len))
+    return -EINTR;
+  while (len) {
+    struct pipe_buffer buf = {
+        .ops = &nullfs_zero_pipe_buf_ops,
+        .page = ZERO_PAGE(0),
+        .offset = 0,
+        .len = min_t(size_t, len, PAGE_SIZE),
+    };
+    ssize_t ret = add_to_pipe(pipe, &buf);
+
+    if (ret <= 0) {
+      if (!total)
+        total = ret;
+      break;
+    }
+    total += ret;
+    len -= ret;
+  }
+
+  if (total > 0)
+    *ppos += total;
+  return total;
+}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+/**
+ * mmap of nulled files: read faults map the shared zero page read only.
+ * Every shared writable mapping gets a scratch page of its own, which
+ * write faults map at every offset. Whatever ends up in the scratch page
+ * is never written back, so mappings of any size cost at most a page and
+ * msync/munmap have nothing to do. The page is referenced from
+ * vm_private_data and follows the mapping through splits and forks.
+ *
+ * Private mappings can be copied on write, which VM_PFNMAP does not
+ * allow, so they are VM_MIXEDMAP instead. They only ever map the zero
+ * page, the first write to it is copied into anonymous memory by the
+ * core mm.
+ **/
+static vm_fault_t nullfs_map_pfn(struct vm_fault *vmf, bool write) {
+  struct vm_area_struct *vma = vmf->vma;
+  unsigned long pfn = page_to_pfn(ZERO_PAGE(vmf->address));
+
+  if (!(vma->vm_flags & VM_SHARED))
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+    return vmf_insert_mixed(vma, vmf->address, pfn);
+#else
+    return vmf_insert_mixed(vma, vmf->address, __pfn_to_pfn_t(pfn, 0));
+#endif
+
+  if (write && vma->vm_private_data)
+    return vmf_insert_pfn_prot(vma, vmf->address,
+                               page_to_pfn(vma->vm_private_data),
+                               vm_get_page_prot(vma->vm_flags));
+
+  return vmf_insert_pfn_prot(vma, vmf->address, pfn,
+                             vm_get_page_prot(vma->vm_flags & ~VM_WRITE));
+}
+
+static vm_fault_t fault_null(struct vm_fault *vmf) {
+  struct inode *inode = file_inode(vmf->vma->vm_file);
+
+  if (vmf->pgoff >= DIV_ROUND_UP(i_size_read(inode), PAGE_SIZE))
+    return VM_FAULT_SIGBUS;
+
+  return nullfs_map_pfn(vmf, vmf->flags & FAULT_FLAG_WRITE);
+}
+
+static vm_fault_t pfn_mkwrite_null(struct vm_fault *vmf) {
+  /**
+   * first write to a page which has been mapped by a read fault:
+   * replace the zero page with the scratch page
+   **/
+  zap_vma_ptes(vmf->vma, vmf->address & PAGE_MASK, PAGE_SIZE);
+  return nullfs_map_pfn(vmf, true);
+}
+
+static void nullfs_vm_open(struct vm_area_struct *vma) {
+  if (vma->vm_private_data)
+    get_page(vma->vm_private_data);
+}
+
+static void nullfs_vm_close(struct vm_area_struct *vma) {
+  if (vma->vm_private_data)
+    put_page(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct nullfs_vm_ops = {
+    .open = nullfs_vm_open,
+    .close = nullfs_vm_close,
+    .fault = fault_null,
+    .pfn_mkwrite = pfn_mkwrite_null,
+};
+
+static int mmap_null(struct file *filp, struct vm_area_struct *vma) {
+  vm_flags_t flags = VM_DONTEXPAND | VM_DONTDUMP;
+
+  if (vma->vm_flags & VM_SHARED) {
+    flags |= VM_PFNMAP;
+    if (vma->vm_flags & VM_MAYWRITE) {
+      vma->vm_private_data = alloc_page(GFP_HIGHUSER | __GFP_ZERO);
+      if (!vma->vm_private_data)
+        return -ENOMEM;
+    }
+  } else {
+    flags |= VM_MIXEDMAP;
+  }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+  vm_flags_set(vma, flags);
+#else
+  vma->vm_flags |= flags;
+#endif
+  vma->vm_ops = &nullfs_vm_ops;
+  return 0;
+}
+#endif
+
+/**
+ * fallocate and SEEK_DATA/SEEK_HOLE
+ *
+ * Without the sparse option only the size changes and the whole file is
+ * data, with it the ranges are recorded in the extent sets.
+ **/
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+static int nullfs_shrink_size(struct inode *inode, loff_t offset,
+                              loff_t len) {
+#if BITS_PER_LONG == 64
+  loff_t old = READ_ONCE(inode->i_size), cur;
+
+  for (;;) {
+    if (offset + len >= old)
+      return -EINVAL;
+    cur = cmpxchg(&inode->i_size, old, old - len);
+    if (cur == old)
+      break;
+    old = cur;
+  }
+#else
+  loff_t old;
+
+  inode_lock(inode);
+  old = i_size_read(inode);
+  if (offset + len >= old) {
+    inode_unlock(inode);
+    return -EINVAL;
+  }
+  i_size_write(inode, old - len);
+  inode_unlock(inode);
+#endif
+  nullfs_size_sync(inode);
+  return 0;
+}
+
+static long nullfs_fallocate(struct file *file, int mode, loff_t offset,
+                             loff_t len) {
+  struct inode *inode = file_inode(file);
+  bool sparse = nullfs_sparse(inode);
+  loff_t pos = offset, old = 0;
+  ssize_t ret;
+  int err;
+
+  if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+               FALLOC_FL_ZERO_RANGE | FALLOC_FL_COLLAPSE_RANGE))
+    return -EOPNOTSUPP;
+
+  switch (mode & ~FALLOC_FL_KEEP_SIZE) {
+  case FALLOC_FL_PUNCH_HOLE:
+    if (!sparse)
+      return 0;
+    return nullfs_extents_update(inode, NULLFS_EXT_PUNCH, offset,
+                                 offset + len, GFP_KERNEL);
+  case FALLOC_FL_COLLAPSE_RANGE:
+    if ((offset | len) & (inode->i_sb->s_blocksize - 1))
+      return -EINVAL;
+    err = nullfs_shrink_size(inode, offset, len);
+    if (err || !sparse)
+      return err;
+    return nullfs_extents_update(inode, NULLFS_EXT_COLLAPSE, offset,
+                                 offset + len, GFP_KERNEL);
+  case FALLOC_FL_ZERO_RANGE:
+  case 0:
+    if (!(mode & FALLOC_FL_KEEP_SIZE)) {
+      ret = nullfs_grow_size(inode, &pos, len, false, &old);
+      if (ret < 0)
+        return ret;
+    }
+    if (!sparse)
+      return 0;
+    err = nullfs_extents_update(inode,
+                                mode & FALLOC_FL_ZERO_RANGE ? NULLFS_EXT_ZERO
+                                                            : NULLFS_EXT_ALLOC,
+                                offset, offset + len, GFP_KERNEL);
+    if (err && !(mode & FALLOC_FL_KEEP_SIZE))
+      nullfs_undo_grow(inode, old, pos);
+    return err;
+  }
+  return -EOPNOTSUPP;
+}
+#endif
+
+static loff_t nullfs_seek_extent(struct nullfs_extents *ext, loff_t pos,
+                                 loff_t size, int whence) {
+  struct nullfs_range *r;
+
+  spin_lock(&ext->lock);
+  r = nullfs_range_lookup(&ext->data, pos);
+  if (r && r->end > pos) {
+    if (whence == SEEK_HOLE)
+      pos = min_t(loff_t, r->end, size);
+  } else if (whence == SEEK_DATA) {
+    r = r ? nullfs_range_next(r) : nullfs_range_first(&ext->data);
+    pos = r && r->start < size ? r->start : -ENXIO;
+  }
+  spin_unlock(&ext->lock);
+  return pos;
+}
+
+static loff_t nullfs_llseek(struct file *file, loff_t offset, int whence) {
+  struct inode *inode = file_inode(file);
+  struct nullfs_extents *ext;
+  loff_t pos = offset;
+
+  if ((whence != SEEK_DATA && whence != SEEK_HOLE) || !nullfs_sparse(inode))
+    return generic_file_llseek(file, offset, whence);
+  if (offset < 0 || offset >= i_size_read(inode))
+    return -ENXIO;
+
+  ext = nullfs_extents(inode);
+  if (ext)
+    pos = nullfs_seek_extent(ext, offset, i_size_read(inode), whence);
+  else if (whence == SEEK_DATA)
+    pos = -ENXIO;
+  if (pos < 0)
+    return pos;
+  return vfs_setpos(file, pos, inode->i_sb->s_maxbytes);
+}
+
+const struct file_operations nullfs_file_operations = {
+    .open = nullfs_open,
+    .write = write_null,
+    .read = read_null,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+    .write_iter = write_iter_null,
+    .read_iter = read_iter_null,
+#endif
+    .splice_write = splice_write_null,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+    .splice_read = splice_read_null,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+    .mmap = mmap_null,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+    .fallocate = nullfs_fallocate,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+    .iopoll = nullfs_iopoll,
+#endif
+    .llseek = nullfs_llseek,
+    .fsync = nullfs_fsync,
+};
+
+/**
+ * Memory budget for kept files
+ *
+ * Every kept file charges its size, rounded up to full pages, against the
+ * keep_max budget of the mount: that is the most page cache the file can
+ * pin, holes included, as reading them instantiates zeroed pages. The
+ * charge is only changed with the inode lock held. Once the budget is
+ * exhausted a write either fails with ENOSPC or, with keep_policy=null,
+ * the file drops its page cache and is nulled from then on.
+ **/
+static int nullfs_keep_charge(struct inode *inode, loff_t end) {
+  struct nullfs_fs_info *fsi = inode->i_sb->s_fs_info;
+  struct nullfs_file_ext *nf = nullfs_file_ext_get(inode, GFP_KERNEL);
+  u64 max = READ_ONCE(fsi->mount_opts.keep_max);
+  u64 want = round_up(max_t(loff_t, end, i_size_read(inode)), PAGE_SIZE);
+  s64 delta;
+
+  if (!nf)
+    return -ENOMEM;
+  if (nf->nulled || want <= nf->charged)
+    return 0;
+  delta = want - nf->charged;
+  percpu_counter_add(&fsi->keep_used, delta);
+  if (max && percpu_counter_compare(&fsi->keep_used, max) > 0) {
+    percpu_counter_sub(&fsi->keep_used, delta);
+    return -ENOSPC;
+  }
+  nf->charged = want;
+  return 0;
+}
+
+/* drop the charge down to what the current size needs */
+static void nullfs_keep_settle(struct inode *inode) {
+  struct nullfs_fs_info *fsi = inode->i_sb->s_fs_info;
+  struct nullfs_file_ext *nf = nullfs_file_ext(inode);
+  u64 want;
+
+  if (!nf)
+    return;
+  want = nf->nulled ? 0 : round_up(i_size_read(inode), PAGE_SIZE);
+  if (want >= nf->charged)
+    return;
+  percpu_counter_sub(&fsi->keep_used, nf->charged - want);
+  nf->charged = want;
+}
+
+/**
+ * make room for data up to end, returns 0 if the data can be kept,
+ * 1 if the file has been nulled instead
+ **/
+static int nullfs_keep_reserve(struct inode *inode, loff_t end) {
+  struct nullfs_fs_info *fsi = inode->i_sb->s_fs_info;
+  struct nullfs_file_ext *nf;
+  int err;
+
+  if (nullfs_nulled(inode))
+    return 1;
+  err = nullfs_keep_charge(inode, end);
+  if (!err)
+    return 0;
+  if (err != -ENOSPC ||
+      READ_ONCE(fsi->mount_opts.keep_policy) != NULLFS_KEEP_NULL)
+    return err;
+  nf = nullfs_file_ext(inode);
+  WRITE_ONCE(nf->nulled, true);
+  truncate_pagecache(inode, 0);
+  nullfs_keep_settle(inode);
+  printk(KERN_INFO "nullfsvfs: keep_max reached, nulling inode %lu\n",
+         inode->i_ino);
+  return 1;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+static ssize_t nullfs_keep_write_iter(struct kiocb *iocb,
+                                      struct iov_iter *from) {
+  struct inode *inode = file_inode(iocb->ki_filp);
+  u64 start = nullfs_lat_start(inode->i_sb);
+  ssize_t ret;
+  size_t len;
+  int keep;
+
+  if (nullfs_nulled(inode))
+    return write_iter_null(iocb, from);
+
+  inode_lock(inode);
+  ret = generic_write_checks(iocb, from);
+  if (ret <= 0)
+    goto out;
+  if (nullfs_over_size(inode, iocb->ki_pos + ret - i_size_read(inode))) {
+    ret = -ENOSPC;
+    goto out;
+  }
+  keep = nullfs_keep_reserve(inode, iocb->ki_pos + ret);
+  if (keep > 0) {
+    inode_unlock(inode);
+    return write_iter_null(iocb, from);
+  }
+  if (keep < 0) {
+    ret = keep;
+    goto out;
+  }
+  len = ret;
+  ret = __generic_file_write_iter(iocb, from);
+  trace_nullfs_write(inode, ret > 0 ? iocb->ki_pos - ret : iocb->ki_pos, len,
+                     ret, true);
+  nullfs_stats_io(iocb->ki_filp, true, ret);
+  nullfs_keep_settle(inode);
+  nullfs_size_sync(inode);
+out:
+  inode_unlock(inode);
+  if (ret > 0)
+    ret = generic_write_sync(iocb, ret);
+  nullfs_lat_end(inode->i_sb, NULLFS_LAT_WRITE, start);
+  return ret;
+}
+
+static ssize_t nullfs_keep_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+  struct inode *inode = file_inode(iocb->ki_filp);
+  size_t len = iov_iter_count(to);
+  loff_t pos = iocb->ki_pos;
+  u64 start;
+  ssize_t ret;
+
+  if (nullfs_nulled(inode))
+    return read_iter_null(iocb, to);
+  start = nullfs_lat_start(inode->i_sb);
+  ret = generic_file_read_iter(iocb, to);
+  trace_nullfs_read(inode, pos, len, ret, true);
+  nullfs_stats_io(iocb->ki_filp, false, ret);
+  nullfs_lat_end(inode->i_sb, NULLFS_LAT_READ, start);
+  return ret;
+}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+static int nullfs_keep_mmap(struct file *filp, struct vm_area_struct *vma) {
+  if (nullfs_nulled(file_inode(filp)))
+    return mmap_null(filp, vma);
+  return generic_file_mmap(filp, vma);
+}
+#endif
+
+const struct file_operations nullfs_real_file_operations = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+    .read_iter = nullfs_keep_read_iter,
+    .write_iter = nullfs_keep_write_iter,
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+    .read_iter = generic_file_read_iter,
+    .write_iter = generic_file_write_iter,
+#else
+    .aio_read = generic_file_aio_read,
+    .aio_write = generic_file_aio_write,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+    .mmap = nullfs_keep_mmap,
+#else
+    .mmap = generic_file_mmap,
+#endif
+    .fsync = nullfs_fsync,
+    .llseek = generic_file_llseek,
+};
+
+#if NULLFS_HAVE_WRITEBACK
+/**
+ * cache=writeback
+ *
+ * Nulled files go through the page cache: writers dirty folios and are
+ * throttled by balance_dirty_pages() against the dirty limits of the
+ * per mount bdi, like on a disk based file system. Writeback collects
+ * the dirty folios in batches, charges every batch like one request
+ * against bw=, iops= and lat= and then ends the writeback without doing
+ * any I/O. Clean folios are reclaimed as usual and read back as zeros.
+ *
+ * simple_write_end() is only reachable through ram_aops, so the address
+ * space operations are a copy of it set up at module init.
+ **/
+static struct address_space_operations nullfs_wb_aops;
+
+static void nullfs_wb_complete(struct inode *inode, struct folio_batch *fbatch,
+                               size_t bytes) {
+  unsigned int i;
+
+  nullfs_throttle(inode, bytes);
+  for (i = 0; i < folio_batch_count(fbatch); i++)
+    folio_end_writeback(fbatch->folios[i]);
+  folio_batch_reinit(fbatch);
+}
+
+/* folios under writeback can not go away, no reference is needed */
+static int nullfs_writepages(struct address_space *mapping,
+                             struct writeback_control *wbc) {
+  struct folio_batch fbatch;
+  struct folio *folio = NULL;
+  size_t bytes = 0;
+  int err = 0;
+
+  folio_batch_init(&fbatch);
+  while ((folio = writeback_iter(mapping, wbc, folio, &err))) {
+    folio_start_writeback(folio);
+    folio_unlock(folio);
+    bytes += folio_size(folio);
+    if (!folio_batch_add(&fbatch, folio)) {
+      nullfs_wb_complete(mapping->host, &fbatch, bytes);
+      bytes = 0;
+    }
+  }
+  if (folio_batch_count(&fbatch))
+    nullfs_wb_complete(mapping->host, &fbatch, bytes);
+  return err;
+}
+
+static void nullfs_wb_init(void) {
+  nullfs_wb_aops = ram_aops;
+  nullfs_wb_aops.dirty_folio = filemap_dirty_folio;
+  nullfs_wb_aops.writepages = nullfs_writepages;
+  nullfs_wb_aops.migrate_folio = filemap_migrate_folio;
+}
+
+/* generic_file_write_iter(), with size= enforced like for kept files */
+static ssize_t nullfs_cache_write_iter(struct kiocb *iocb,
+                                       struct iov_iter *from) {
+  struct inode *inode = file_inode(iocb->ki_filp);
+  u64 start = nullfs_lat_start(inode->i_sb);
+  size_t len = iov_iter_count(from);
+  ssize_t ret;
+
+  inode_lock(inode);
+  ret = generic_write_checks(iocb, from);
+  if (ret <= 0)
+    goto out;
+  if (nullfs_over_size(inode, iocb->ki_pos + ret - i_size_read(inode))) {
+    ret = -ENOSPC;
+    goto out;
+  }
+  ret = __generic_file_write_iter(iocb, from);
+  nullfs_size_sync(inode);
+out:
+  inode_unlock(inode);
+  if (ret > 0)
+    ret = generic_write_sync(iocb, ret);
+  trace_nullfs_write(inode, ret > 0 ? iocb->ki_pos - ret : iocb->ki_pos, len,
+                     ret, false);
+  nullfs_stats_io(iocb->ki_filp, true, ret);
+  nullfs_lat_end(inode->i_sb, NULLFS_LAT_WRITE, start);
+  return ret;
+}
+
+static ssize_t nullfs_cache_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+  struct inode *inode = file_inode(iocb->ki_filp);
+  u64 start = nullfs_lat_start(inode->i_sb);
+  size_t len = iov_iter_count(to);
+  loff_t pos = iocb->ki_pos;
+  ssize_t ret;
+
+  ret = generic_file_read_iter(iocb, to);
+  trace_nullfs_read(inode, pos, len, ret, false);
+  nullfs_stats_io(iocb->ki_filp, false, ret);
+  nullfs_lat_end(inode->i_sb, NULLFS_LAT_READ, start);
+  return ret;
+}
+
+/**
+ * nothing is ever allocated, fallocate only extends the file. Punching
+ * and zeroing would have to drop cached data, they are not supported.
+ **/
+static long nullfs_cache_fallocate(struct file *file, int mode, loff_t offset,
+                                   loff_t len) {
+  struct inode *inode = file_inode(file);
+  loff_t end = offset + len;
+  int err = 0;
+
+  if (mode & ~FALLOC_FL_KEEP_SIZE)
+    return -EOPNOTSUPP;
+  if (mode & FALLOC_FL_KEEP_SIZE)
+    return 0;
+
+  inode_lock(inode);
+  if (end > i_size_read(inode)) {
+    err = inode_newsize_ok(inode, end);
+    if (!err && nullfs_over_size(inode, end - i_size_read(inode)))
+      err = -ENOSPC;
+    if (!err) {
+      i_size_write(inode, end);
+      nullfs_size_sync(inode);
+    }
+  }
+  inode_unlock(inode);
+  return err;
 }
 
-static struct kobj_attribute exclude_attribute =
-    __ATTR(exclude, NULLFS_SYSFS_MODE, exclude_show, exclude_store);
+/* fsync waits for writeback of the range, then adds fsync_lat= */
+static int nullfs_cache_fsync(struct file *filp, loff_t start, loff_t end,
+                              int datasync) {
+  int err = file_write_and_wait_range(filp, start, end);
 
-static struct attribute *attrs[] = {
-    &exclude_attribute.attr,
-    NULL, /* need to NULL terminate the list of attributes */
-};
+  if (err)
+    return err;
+  return nullfs_fsync(filp, start, end, datasync);
+}
 
-static struct attribute_group attr_group = {
-    .attrs = attrs,
+static const struct file_operations nullfs_cache_file_operations = {
+    .read_iter = nullfs_cache_read_iter,
+    .write_iter = nullfs_cache_write_iter,
+    .mmap = generic_file_mmap,
+    .splice_read = filemap_splice_read,
+    .splice_write = iter_file_splice_write,
+    .fsync = nullfs_cache_fsync,
+    .fallocate = nullfs_cache_fallocate,
+    .llseek = generic_file_llseek,
 };
+#endif
 
-static struct kobject *exclude_kobj;
-
-/**
- * regular filesystem handlers, inode handling etc..
- **/
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
-static int nullfs_getattr(struct mnt_idmap *idmap, const struct path *path,
-                          struct kstat *stat, u32 request_mask,
-                          unsigned int flags) {
-  struct inode *inode = path->dentry->d_inode;
+static int nullfs_setattr(struct mnt_idmap *idmap, struct dentry *dentry,
+                          struct iattr *attr) {
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
-static int nullfs_getattr(struct user_namespace *mnt_userns,
-                          const struct path *path, struct kstat *stat,
-                          u32 request_mask, unsigned int flags) {
-  struct inode *inode = path->dentry->d_inode;
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
-static int nullfs_getattr(const struct path *path, struct kstat *stat,
-                          u32 request_mask, unsigned int flags) {
-  struct inode *inode = path->dentry->d_inode;
+static int nullfs_setattr(struct user_namespace *mnt_userns,
+                          struct dentry *dentry, struct iattr *attr) {
 #else
-static int nullfs_getattr(struct vfsmount *mnt, struct dentry *dentry,
-                          struct kstat *stat) {
-  struct inode *inode = dentry->d_inode;
+static int nullfs_setattr(struct dentry *dentry, struct iattr *attr) {
 #endif
+  struct inode *inode = dentry->d_inode;
+  bool resize = S_ISREG(inode->i_mode) && (attr->ia_valid & ATTR_SIZE);
+  bool kept = resize && inode->i_fop == &nullfs_real_file_operations;
+  loff_t old = i_size_read(inode);
+  int err;
 
-  unsigned long npages;
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
-  generic_fillattr(&nop_mnt_idmap, request_mask, inode, stat);
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
-  generic_fillattr(&nop_mnt_idmap, inode, stat);
+  if (resize && nullfs_over_size(inode, attr->ia_size - i_size_read(inode)))
+    return -ENOSPC;
+  if (kept) {
+    err = nullfs_keep_reserve(inode, attr->ia_size);
+    if (err < 0)
+      return err;
+  }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+  err = simple_setattr(idmap, dentry, attr);
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
-  generic_fillattr(&init_user_ns, inode, stat);
+  err = simple_setattr(mnt_userns, dentry, attr);
 #else
-  generic_fillattr(inode, stat);
+  err = simple_setattr(dentry, attr);
 #endif
-  npages = (inode->i_size + PAGE_SIZE - 1) >> PAGE_SHIFT;
-  stat->blocks = npages << (PAGE_SHIFT - 9);
-  return 0;
+  if (kept)
+    nullfs_keep_settle(inode);
+  if (resize)
+    nullfs_size_sync(inode);
+  if (!err && resize && attr->ia_size < old && nullfs_sparse(inode))
+    err = nullfs_extents_update(inode, NULLFS_EXT_PUNCH, attr->ia_size,
+                                inode->i_sb->s_maxbytes, GFP_KERNEL);
+  if (!err && resize && !attr->ia_size && nullfs_file_ext(inode)) {
+    kfree(nullfs_file_ext(inode)->csum);
+    nullfs_file_ext(inode)->csum = NULL;
+  }
+  return err;
 }
 
-static ssize_t write_null(struct file *filp, const char *buf, size_t count,
-                          loff_t *offset) {
-  /**
-   * keep track of size
-   **/
-  struct inode *inode = file_inode(filp);
-  i_size_write(inode, (inode->i_size + count));
-  return count;
-}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+#define NULLFS_FIEMAP_BATCH 16
 
-static ssize_t read_null(struct file *filp, char *buf, size_t count,
-                         loff_t *offset) {
+struct nullfs_fiemap_piece {
+  loff_t start;
+  loff_t end;
+  u32 flags;
+};
 
-  /**
-   * Pretend we have returned some data
-   * during file read
-   **/
-  int nbytes;
-  struct inode *inode = filp->f_inode;
+/**
+ * Collect the next allocated pieces from pos on, split into written and
+ * unwritten parts. fiemap_fill_next_extent copies to userspace and can
+ * not be called under the spinlock, so extents are handed out in batches.
+ **/
+static int nullfs_fiemap_collect(struct nullfs_extents *ext, loff_t *pos,
+                                 loff_t end, struct nullfs_fiemap_piece *p) {
+  struct nullfs_range *a, *d;
+  loff_t s = *pos, e;
+  int n = 0;
 
-  if (*offset >= inode->i_size) {
-    return 0;
+  spin_lock(&ext->lock);
+  a = nullfs_range_lookup(&ext->alloc, s);
+  if (!a || a->end <= s)
+    a = a ? nullfs_range_next(a) : nullfs_range_first(&ext->alloc);
+  while (a && a->start < end && n < NULLFS_FIEMAP_BATCH) {
+    s = max_t(loff_t, a->start, s);
+    e = min_t(loff_t, a->end, end);
+    d = nullfs_range_lookup(&ext->data, s);
+    p[n].start = s;
+    p[n].flags = FIEMAP_EXTENT_UNKNOWN;
+    if (d && d->end > s) {
+      p[n].end = min_t(loff_t, d->end, e);
+    } else {
+      d = d ? nullfs_range_next(d) : nullfs_range_first(&ext->data);
+      p[n].end = d && d->start < e ? d->start : e;
+      p[n].flags |= FIEMAP_EXTENT_UNWRITTEN;
+    }
+    s = p[n++].end;
+    if (s >= e)
+      a = nullfs_range_next(a);
   }
-
-  nbytes = min((size_t)inode->i_size, count);
-  *offset += nbytes;
-
-  return nbytes;
+  spin_unlock(&ext->lock);
+  *pos = s;
+  return n;
 }
 
-const struct file_operations nullfs_file_operations = {
-    .write = write_null,
-    .read = read_null,
-    .llseek = noop_llseek,
-    .fsync = noop_fsync,
-};
+static int nullfs_fiemap(struct inode *inode,
+                         struct fiemap_extent_info *fieinfo, u64 start,
+                         u64 len) {
+  struct nullfs_fiemap_piece p[NULLFS_FIEMAP_BATCH], last;
+  struct nullfs_extents *ext = nullfs_extents(inode);
+  bool pending = false;
+  loff_t pos = start;
+  int i, n, err;
 
-const struct file_operations nullfs_real_file_operations = {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
-    .read_iter = generic_file_read_iter,
-    .write_iter = generic_file_write_iter,
-#else
-    .aio_read = generic_file_aio_read,
-    .aio_write = generic_file_aio_write,
+  if (!nullfs_sparse(inode) || inode->i_fop != &nullfs_file_operations)
+    return -EOPNOTSUPP;
+  err = fiemap_prep(inode, fieinfo, start, &len, 0);
+  if (err || !ext)
+    return err;
+
+  while ((n = nullfs_fiemap_collect(ext, &pos, start + len, p)) > 0) {
+    for (i = 0; i < n; i++) {
+      if (pending) {
+        err = fiemap_fill_next_extent(fieinfo, last.start, 0,
+                                      last.end - last.start, last.flags);
+        if (err)
+          return err < 0 ? err : 0;
+      }
+      last = p[i];
+      pending = true;
+    }
+  }
+  if (!pending)
+    return 0;
+  err = fiemap_fill_next_extent(fieinfo, last.start, 0, last.end - last.start,
+                                last.flags | FIEMAP_EXTENT_LAST);
+  return err < 0 ? err : 0;
+}
 #endif
-    .mmap = generic_file_mmap,
-    .fsync = noop_fsync,
-    .llseek = generic_file_llseek,
-};
 
 const struct inode_operations nullfs_file_inode_operations = {
-    .setattr = simple_setattr,
+    .setattr = nullfs_setattr,
     .getattr = nullfs_getattr,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+    .fiemap = nullfs_fiemap,
+#endif
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
     .set_acl = nullfs_set_acl,
 #endif
@@ -339,28 +3867,86 @@ static const struct address_space_operations nullfs_aops = {
 };
 #endif
 
+#if !defined(FMODE_CAN_ODIRECT) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
+/**
+ * ram_aops has no direct_IO and open(O_DIRECT) insists on it before
+ * FMODE_CAN_ODIRECT, nulled files never have pages in their mapping
+ **/
+static const struct address_space_operations nullfs_null_aops = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+    .dirty_folio = noop_dirty_folio,
+#else
+    .set_page_dirty = __set_page_dirty_no_writeback,
+#endif
+    .direct_IO = noop_direct_IO,
+};
+#endif
+
 static const struct inode_operations nullfs_dir_inode_operations;
 static const struct super_operations nullfs_ops;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(7, 0, 0)
-enum { Opt_write, Opt_mode, Opt_uid, Opt_gid, Opt_err };
+enum {
+  Opt_write,
+  Opt_mode,
+  Opt_uid,
+  Opt_gid,
+  Opt_bw,
+  Opt_iops,
+  Opt_lat,
+  Opt_fsync_lat,
+  Opt_keep_max,
+  Opt_keep_policy,
+  Opt_size,
+  Opt_nr_inodes,
+  Opt_enforce,
+  Opt_checksum,
+  Opt_pattern,
+  Opt_sparse,
+  Opt_dio_align,
+  Opt_stats,
+  Opt_cache,
+  Opt_image,
+  Opt_err
+};
 
 static const match_table_t tokens = {{Opt_write, "write=%s"},
                                      {Opt_mode, "mode=%s"},
                                      {Opt_uid, "uid=%s"},
                                      {Opt_gid, "gid=%s"},
+                                     {Opt_bw, "bw=%s"},
+                                     {Opt_iops, "iops=%s"},
+                                     {Opt_lat, "lat=%s"},
+                                     {Opt_fsync_lat, "fsync_lat=%s"},
+                                     {Opt_keep_max, "keep_max=%s"},
+                                     {Opt_keep_policy, "keep_policy=%s"},
+                                     {Opt_size, "size=%s"},
+                                     {Opt_nr_inodes, "nr_inodes=%s"},
+                                     {Opt_enforce, "enforce"},
+                                     {Opt_checksum, "checksum=%s"},
+                                     {Opt_pattern, "pattern=%s"},
+                                     {Opt_sparse, "sparse"},
+                                     {Opt_dio_align, "dio_align=%s"},
+                                     {Opt_stats, "stats"},
+                                     {Opt_cache, "cache=%s"},
+                                     {Opt_image, "image=%s"},
                                      {Opt_err, NULL}};
 
 static int nullfs_parse_options(char *data, struct nullfs_mount_opts *opts) {
   substring_t args[MAX_OPT_ARGS];
+  char value[32];
   char *option;
   int token;
   int opt;
   char *p;
   kuid_t uid;
   kgid_t gid;
+  int err;
   opts->write = NULL;
+  opts->image = NULL;
   opts->mode = NULLFS_DEFAULT_MODE;
+  opts->dio_align = NULLFS_DEFAULT_DIO_ALIGN;
   opts->uid = GLOBAL_ROOT_UID;
   opts->gid = GLOBAL_ROOT_GID;
   // maybe use fs_parse here? Not sure which kernel versions
@@ -373,8 +3959,12 @@ static int nullfs_parse_options(char *data, struct nullfs_mount_opts *opts) {
     switch (token) {
     case Opt_write:
       option = match_strdup(&args[0]);
-      opts->write = option;
-      strncpy(exclude, option, sizeof(exclude));
+      if (!option)
+        return -ENOMEM;
+      err = nullfs_add_pattern(&opts->write, option);
+      kfree(option);
+      if (err)
+        return err;
       break;
     case Opt_uid:
       if (match_int(&args[0], &opt))
@@ -397,11 +3987,110 @@ static int nullfs_parse_options(char *data, struct nullfs_mount_opts *opts) {
         return -EINVAL;
       opts->mode = opt & S_IALLUGO;
       break;
+    case Opt_bw:
+      match_strlcpy(value, &args[0], sizeof(value));
+      if (nullfs_parse_size(value, &opts->bw))
+        return -EINVAL;
+      break;
+    case Opt_iops:
+      match_strlcpy(value, &args[0], sizeof(value));
+      if (kstrtoull(value, 0, &opts->iops))
+        return -EINVAL;
+      break;
+    case Opt_lat:
+      match_strlcpy(value, &args[0], sizeof(value));
+      if (nullfs_parse_duration(value, &opts->lat))
+        return -EINVAL;
+      break;
+    case Opt_fsync_lat:
+      match_strlcpy(value, &args[0], sizeof(value));
+      if (nullfs_parse_duration(value, &opts->fsync_lat))
+        return -EINVAL;
+      break;
+    case Opt_keep_max:
+      match_strlcpy(value, &args[0], sizeof(value));
+      if (nullfs_parse_size(value, &opts->keep_max))
+        return -EINVAL;
+      break;
+    case Opt_keep_policy:
+      match_strlcpy(value, &args[0], sizeof(value));
+      if (!strcmp(value, "enospc"))
+        opts->keep_policy = NULLFS_KEEP_ENOSPC;
+      else if (!strcmp(value, "null"))
+        opts->keep_policy = NULLFS_KEEP_NULL;
+      else
+        return -EINVAL;
+      break;
+    case Opt_size:
+      match_strlcpy(value, &args[0], sizeof(value));
+      if (nullfs_parse_size(value, &opts->size))
+        return -EINVAL;
+      break;
+    case Opt_nr_inodes:
+      match_strlcpy(value, &args[0], sizeof(value));
+      if (nullfs_parse_size(value, &opts->nr_inodes))
+        return -EINVAL;
+      break;
+    case Opt_enforce:
+      opts->enforce = true;
+      break;
+    case Opt_checksum:
+      match_strlcpy(value, &args[0], sizeof(value));
+      if (!strcmp(value, "crc32c"))
+        opts->checksum = NULLFS_CSUM_CRC32C;
+      else if (!strcmp(value, "xxhash64"))
+        opts->checksum = NULLFS_CSUM_XXHASH64;
+      else
+        return -EINVAL;
+      err = nullfs_check_checksum(opts->checksum);
+      if (err)
+        return err;
+      break;
+    case Opt_pattern:
+      match_strlcpy(value, &args[0], sizeof(value));
+      if (!strcmp(value, "zero"))
+        opts->pattern = NULLFS_PATTERN_ZERO;
+      else if (!strcmp(value, "prng"))
+        opts->pattern = NULLFS_PATTERN_PRNG;
+      else if (!strcmp(value, "text"))
+        opts->pattern = NULLFS_PATTERN_TEXT;
+      else
+        return -EINVAL;
+      break;
+    case Opt_sparse:
+      opts->sparse = true;
+      break;
+    case Opt_dio_align:
+      match_strlcpy(value, &args[0], sizeof(value));
+      if (kstrtouint(value, 0, &opts->dio_align))
+        return -EINVAL;
+      err = nullfs_check_dio_align(opts->dio_align);
+      if (err)
+        return err;
+      break;
+    case Opt_stats:
+      opts->stats = true;
+      break;
+    case Opt_cache:
+      match_strlcpy(value, &args[0], sizeof(value));
+      if (!strcmp(value, "none"))
+        opts->cache = NULLFS_CACHE_NONE;
+      else if (!strcmp(value, "writeback"))
+        opts->cache = NULLFS_CACHE_WRITEBACK;
+      else
+        return -EINVAL;
+      err = nullfs_check_cache(opts->cache);
+      if (err)
+        return err;
+      break;
+    case Opt_image:
+      kfree(opts->image);
+      opts->image = match_strdup(&args[0]);
+      if (!opts->image)
+        return -ENOMEM;
+      break;
     }
   }
-  if (opts->write != NULL)
-    printk(KERN_INFO "nullfsvfs: will keep data for files matching: [%s]\n",
-           opts->write);
   return 0;
 }
 #endif
@@ -409,8 +4098,14 @@ static int nullfs_parse_options(char *data, struct nullfs_mount_opts *opts) {
 static int nullfs_show_options(struct seq_file *m, struct dentry *root) {
   struct nullfs_fs_info *fsi = root->d_sb->s_fs_info;
 
-  if (fsi->mount_opts.write != NULL)
-    seq_printf(m, ",write=%s", fsi->mount_opts.write);
+  struct nullfs_patterns *keep;
+  unsigned int i;
+
+  rcu_read_lock();
+  keep = rcu_dereference(fsi->keep);
+  for (i = 0; keep && i < keep->nr; i++)
+    seq_printf(m, ",write=%.*s", keep->pat[i].srclen, keep->pat[i].src);
+  rcu_read_unlock();
   if (!uid_eq(fsi->mount_opts.uid, GLOBAL_ROOT_UID))
     seq_printf(m, ",uid=%u",
                from_kuid_munged(&init_user_ns, fsi->mount_opts.uid));
@@ -419,17 +4114,151 @@ static int nullfs_show_options(struct seq_file *m, struct dentry *root) {
                from_kgid_munged(&init_user_ns, fsi->mount_opts.gid));
   if (fsi->mount_opts.mode != NULLFS_DEFAULT_MODE)
     seq_printf(m, ",mode=%o", fsi->mount_opts.mode);
+  if (READ_ONCE(fsi->bw.rate))
+    seq_printf(m, ",bw=%llu", READ_ONCE(fsi->bw.rate));
+  if (READ_ONCE(fsi->iops.rate))
+    seq_printf(m, ",iops=%llu", READ_ONCE(fsi->iops.rate));
+  if (READ_ONCE(fsi->mount_opts.lat))
+    seq_printf(m, ",lat=%lluns", READ_ONCE(fsi->mount_opts.lat));
+  if (READ_ONCE(fsi->mount_opts.fsync_lat))
+    seq_printf(m, ",fsync_lat=%lluns", READ_ONCE(fsi->mount_opts.fsync_lat));
+  if (READ_ONCE(fsi->mount_opts.keep_max))
+    seq_printf(m, ",keep_max=%llu", READ_ONCE(fsi->mount_opts.keep_max));
+  if (fsi->mount_opts.keep_policy == NULLFS_KEEP_NULL)
+    seq_puts(m, ",keep_policy=null");
+  if (fsi->mount_opts.size)
+    seq_printf(m, ",size=%llu", fsi->mount_opts.size);
+  if (fsi->mount_opts.nr_inodes)
+    seq_printf(m, ",nr_inodes=%llu", fsi->mount_opts.nr_inodes);
+  if (fsi->mount_opts.enforce)
+    seq_puts(m, ",enforce");
+  if (fsi->mount_opts.checksum == NULLFS_CSUM_CRC32C)
+    seq_puts(m, ",checksum=crc32c");
+  else if (fsi->mount_opts.checksum == NULLFS_CSUM_XXHASH64)
+    seq_puts(m, ",checksum=xxhash64");
+  if (fsi->mount_opts.pattern == NULLFS_PATTERN_ZERO)
+    seq_puts(m, ",pattern=zero");
+  else if (fsi->mount_opts.pattern == NULLFS_PATTERN_PRNG)
+    seq_puts(m, ",pattern=prng");
+  else if (fsi->mount_opts.pattern == NULLFS_PATTERN_TEXT)
+    seq_puts(m, ",pattern=text");
+  if (fsi->mount_opts.sparse)
+    seq_puts(m, ",sparse");
+  if (fsi->mount_opts.dio_align != NULLFS_DEFAULT_DIO_ALIGN)
+    seq_printf(m, ",dio_align=%u", fsi->mount_opts.dio_align);
+  if (fsi->mount_opts.stats)
+    seq_puts(m, ",stats");
+  if (fsi->mount_opts.cache == NULLFS_CACHE_WRITEBACK)
+    seq_puts(m, ",cache=writeback");
+
+  return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 1, 0)
+/**
+ * Directory index
+ *
+ * Each entry of a directory gets a stable cookie from a per directory
+ * xarray, the cookie is stored in d_fsdata. readdir continues at the
+ * cookie stored in f_pos, so seeking into a directory with millions of
+ * entries is O(log n) instead of walking the dcache child list with a
+ * cursor as simple_dir_operations does. Cookies 0 and 1 belong to "."
+ * and "..". Lookups are still served by the dcache hash.
+ **/
+#define NULLFS_DIR_LIMIT XA_LIMIT(2, INT_MAX)
+
+static struct nullfs_dir *nullfs_dir(struct inode *inode) {
+  return NULLFS_I(inode)->dir;
+}
+
+static int nullfs_dir_add(struct inode *dir, struct dentry *dentry) {
+  struct nullfs_dir *d = nullfs_dir(dir);
+  u32 cookie;
+  int err;
+
+  err = xa_alloc_cyclic(&d->entries, &cookie, dentry, NULLFS_DIR_LIMIT,
+                        &d->next, GFP_KERNEL);
+  if (err < 0)
+    return err;
+  dentry->d_fsdata = (void *)(unsigned long)cookie;
+  return 0;
+}
+
+static void nullfs_dir_remove(struct inode *dir, struct dentry *dentry) {
+  xa_erase(&nullfs_dir(dir)->entries, (unsigned long)dentry->d_fsdata);
+  dentry->d_fsdata = NULL;
+}
+
+static int nullfs_readdir(struct file *file, struct dir_context *ctx) {
+  struct nullfs_dir *d = nullfs_dir(file_inode(file));
+  struct dentry *child;
+  unsigned long index;
 
+  if (!dir_emit_dots(file, ctx))
+    return 0;
+
+  index = ctx->pos;
+  while ((child = xa_find(&d->entries, &index, INT_MAX, XA_PRESENT))) {
+    struct inode *inode = d_inode(child);
+
+    if (!dir_emit(ctx, child->d_name.name, child->d_name.len, inode->i_ino,
+                  (inode->i_mode >> 12) & 15))
+      break;
+    ctx->pos = ++index;
+  }
   return 0;
 }
 
+static long nullfs_dir_ioctl(struct file *, unsigned int, unsigned long);
+
+static const struct file_operations nullfs_dir_operations = {
+    .read = generic_read_dir,
+    .iterate_shared = nullfs_readdir,
+    .llseek = generic_file_llseek,
+    .fsync = noop_fsync,
+    .unlocked_ioctl = nullfs_dir_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+    .compat_ioctl = compat_ptr_ioctl,
+#endif
+};
+#endif
+
+/**
+ * inode numbers are handed out per superblock, each cpu grabs a batch of
+ * NULLFS_INO_BATCH numbers from the shared counter so concurrent creates
+ * only touch it once every batch. On 64 bit the numbers do not repeat
+ * within a mount.
+ **/
+#define NULLFS_INO_BATCH 1024
+
+static ino_t nullfs_next_ino(struct nullfs_fs_info *fsi) {
+  u64 *next = get_cpu_ptr(fsi->ino_batch);
+  u64 ino = *next;
+
+  if (unlikely(ino % NULLFS_INO_BATCH == 0)) {
+    ino = atomic64_add_return(NULLFS_INO_BATCH, &fsi->next_ino) -
+          NULLFS_INO_BATCH;
+    /* 0 is never a valid inode number, also not once ino_t wrapped */
+    if (unlikely((ino_t)ino == 0))
+      ino++;
+  }
+  *next = ino + 1;
+  put_cpu_ptr(fsi->ino_batch);
+  return ino;
+}
+
 struct inode *nullfs_get_inode(struct super_block *sb, const struct inode *dir,
                                umode_t mode, dev_t dev, struct dentry *dentry) {
-  struct inode *inode = new_inode(sb);
   struct nullfs_fs_info *fsi = sb->s_fs_info;
+  struct inode *inode;
+  bool keep;
 
+  if (nullfs_over_inodes(fsi))
+    return NULL;
+  inode = new_inode(sb);
   if (inode) {
-    inode->i_ino = get_next_ino();
+    percpu_counter_inc(&fsi->inodes);
+    inode->i_ino = nullfs_next_ino(fsi);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
     inode_init_owner(&nop_mnt_idmap, inode, dir, mode);
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
@@ -466,18 +4295,43 @@ struct inode *nullfs_get_inode(struct super_block *sb, const struct inode *dir,
       break;
     case S_IFREG:
       inode->i_op = &nullfs_file_inode_operations;
-      if (fsi->mount_opts.write != NULL && dentry != NULL) {
-        if (strstr(dentry->d_iname, fsi->mount_opts.write) ||
-            strstr(dentry->d_iname, exclude)) {
-          inode->i_fop = &nullfs_real_file_operations;
-          break;
-        }
+      atomic64_set(&NULLFS_I(inode)->file.accounted, 0);
+      NULLFS_I(inode)->file.ext = NULL;
+      keep = dentry != NULL && nullfs_keep_data(fsi, dentry);
+      if (dentry != NULL)
+        trace_nullfs_keep_data(inode, dentry, keep);
+      if (keep) {
+        inode->i_fop = &nullfs_real_file_operations;
+        break;
       }
+#if NULLFS_HAVE_WRITEBACK
+      if (fsi->mount_opts.cache == NULLFS_CACHE_WRITEBACK) {
+        inode->i_fop = &nullfs_cache_file_operations;
+        inode->i_mapping->a_ops = &nullfs_wb_aops;
+        mapping_clear_unevictable(inode->i_mapping);
+        break;
+      }
+#endif
       inode->i_fop = &nullfs_file_operations;
+#if !defined(FMODE_CAN_ODIRECT) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
+      inode->i_mapping->a_ops = &nullfs_null_aops;
+#endif
       break;
     case S_IFDIR:
       inode->i_op = &nullfs_dir_inode_operations;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 1, 0)
+      inode->i_fop = &nullfs_dir_operations;
+      NULLFS_I(inode)->dir = kmalloc(sizeof(struct nullfs_dir), GFP_KERNEL);
+      if (!NULLFS_I(inode)->dir) {
+        iput(inode);
+        return NULL;
+      }
+      xa_init_flags(&nullfs_dir(inode)->entries, XA_FLAGS_ALLOC);
+      nullfs_dir(inode)->next = 0;
+#else
       inode->i_fop = &simple_dir_operations;
+#endif
 
       /* directory inodes start off with i_nlink == 2 (for "." entry) */
       inc_nlink(inode);
@@ -492,26 +4346,57 @@ struct inode *nullfs_get_inode(struct super_block *sb, const struct inode *dir,
   }
   return inode;
 }
+EXPORT_SYMBOL_IF_KUNIT(nullfs_get_inode);
+
+/**
+ * Symlinks
+ *
+ * page_symlink() costs a whole page cache page per symlink, which can
+ * not even be reclaimed. Targets that fit into the unused file state of
+ * the inode are stored right there, other short ones in a kmalloc'ed
+ * copy, and both are served by simple_get_link() without touching the
+ * page cache. Only long targets still get a page.
+ **/
+#define NULLFS_LINK_KMALLOC_MAX 512
+
+static int nullfs_set_link(struct inode *inode, const char *target) {
+  size_t len = strlen(target);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+  char *link = NULL;
+
+  if (len < sizeof(NULLFS_I(inode)->link))
+    link = memcpy(NULLFS_I(inode)->link, target, len + 1);
+  else if (len < NULLFS_LINK_KMALLOC_MAX)
+    link = kmemdup(target, len + 1, GFP_KERNEL_ACCOUNT);
+  if (link) {
+    inode->i_link = link;
+    inode->i_op = &simple_symlink_inode_operations;
+    i_size_write(inode, len);
+    return 0;
+  }
+#endif
+  return page_symlink(inode, target, len + 1);
+}
+
+/* called after the rcu grace period, lockless lookups may use i_link */
+static void nullfs_free_link(struct inode *inode) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+  if (S_ISLNK(inode->i_mode) && inode->i_link != NULLFS_I(inode)->link)
+    kfree(inode->i_link);
+#endif
+}
 
 static inline umode_t nullfs_apply_umask(umode_t mode) {
   return (mode & S_IFMT) | ((mode & S_IALLUGO) & ~current_umask());
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
-static int nullfs_mknod(struct mnt_idmap *idmap, struct inode *dir,
-                        struct dentry *dentry, umode_t mode, dev_t dev)
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
-static int nullfs_mknod(struct user_namespace *mnt_userns, struct inode *dir,
-                        struct dentry *dentry, umode_t mode, dev_t dev)
-#else
-static int nullfs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
-                        dev_t dev)
-#endif
-{
+/* symname is the target for symlinks, which ignore the umask */
+static int nullfs_make_node(struct inode *dir, struct dentry *dentry,
+                            umode_t mode, dev_t dev, const char *symname) {
   struct inode *inode;
   int error = -ENOSPC;
 
-  umode_t masked = nullfs_apply_umask(mode);
+  umode_t masked = symname ? mode : nullfs_apply_umask(mode);
   inode = nullfs_get_inode(dir->i_sb, dir, masked, dev, dentry);
 
   if (inode) {
@@ -521,13 +4406,23 @@ static int nullfs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
     if (mode & S_IFDIR) {
       inode->i_size = PAGE_SIZE;
     }
+    error = 0;
+    if (symname)
+      error = nullfs_set_link(inode, symname);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 1, 0)
+    if (!error)
+      error = nullfs_dir_add(dir, dentry);
+#endif
+    if (error) {
+      iput(inode);
+      return error;
+    }
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 19, 0)
     d_make_persistent(dentry, inode);
 #else
     d_instantiate(dentry, inode);
     dget(dentry); /* Extra count - pin the dentry in core */
 #endif
-    error = 0;
 #ifndef CURRENT_TIME
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
     inode_set_mtime_to_ts(dir, inode_set_ctime_current(dir));
@@ -543,6 +4438,26 @@ static int nullfs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
   return error;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+static int nullfs_mknod(struct mnt_idmap *idmap, struct inode *dir,
+                        struct dentry *dentry, umode_t mode, dev_t dev)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+static int nullfs_mknod(struct user_namespace *mnt_userns, struct inode *dir,
+                        struct dentry *dentry, umode_t mode, dev_t dev)
+#else
+static int nullfs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
+                        dev_t dev)
+#endif
+{
+  u64 start = nullfs_lat_start(dir->i_sb);
+  int error = nullfs_make_node(dir, dentry, mode, dev, NULL);
+
+  trace_nullfs_mknod(dir, dentry, mode, error);
+  nullfs_stats_meta(dir);
+  nullfs_lat_end(dir->i_sb, NULLFS_LAT_MKNOD, start);
+  return error;
+}
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
 static struct dentry *nullfs_mkdir(struct mnt_idmap *idmap, struct inode *dir,
                                    struct dentry *dentry, umode_t mode)
@@ -556,17 +4471,14 @@ static int nullfs_mkdir(struct user_namespace *mnt_userns, struct inode *dir,
 static int nullfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 #endif
 {
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
-  int retval = nullfs_mknod(&nop_mnt_idmap, dir, dentry, mode | S_IFDIR, 0);
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
-  int retval = nullfs_mknod(&init_user_ns, dir, dentry, mode | S_IFDIR, 0);
-#else
-  int retval = nullfs_mknod(dir, dentry, mode | S_IFDIR, 0);
-#endif
+  u64 start = nullfs_lat_start(dir->i_sb);
+  int retval = nullfs_make_node(dir, dentry, mode | S_IFDIR, 0, NULL);
 
   if (!retval)
     inc_nlink(dir);
+  trace_nullfs_mkdir(dir, dentry, mode | S_IFDIR, retval);
+  nullfs_stats_meta(dir);
+  nullfs_lat_end(dir->i_sb, NULLFS_LAT_MKDIR, start);
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
   return ERR_PTR(retval);
@@ -585,37 +4497,8 @@ static int nullfs_symlink(struct user_namespace *mnt_userns, struct inode *dir,
 static int nullfs_symlink(struct inode *dir, struct dentry *dentry,
                           const char *symname)
 #endif
-{
-  struct inode *inode;
-  int error = -ENOSPC;
-
-  inode = nullfs_get_inode(dir->i_sb, dir, S_IFLNK | S_IRWXUGO, 0, dentry);
-  if (inode) {
-    int l = strlen(symname) + 1;
-    error = page_symlink(inode, symname, l);
-    if (!error) {
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 19, 0)
-      d_make_persistent(dentry, inode);
-#else
-      d_instantiate(dentry, inode);
-      dget(dentry);
-#endif
-#ifndef CURRENT_TIME
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
-      inode_set_mtime_to_ts(dir, inode_set_ctime_current(dir));
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
-      dir->i_mtime = inode_set_ctime_current(dir);
-#else
-      dir->i_mtime = dir->i_ctime = current_time(dir);
-#endif
-#else
-      dir->i_mtime = dir->i_ctime = CURRENT_TIME;
-#endif
-    } else
-      iput(inode);
-  }
-  return error;
+{
+  return nullfs_make_node(dir, dentry, S_IFLNK | S_IRWXUGO, 0, symname);
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
@@ -629,13 +4512,13 @@ static int nullfs_create(struct inode *dir, struct dentry *dentry, umode_t mode,
                          bool excl)
 #endif
 {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
-  return nullfs_mknod(&nop_mnt_idmap, dir, dentry, mode | S_IFREG, 0);
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
-  return nullfs_mknod(&init_user_ns, dir, dentry, mode | S_IFREG, 0);
-#else
-  return nullfs_mknod(dir, dentry, mode | S_IFREG, 0);
-#endif
+  u64 start = nullfs_lat_start(dir->i_sb);
+  int error = nullfs_make_node(dir, dentry, mode | S_IFREG, 0, NULL);
+
+  trace_nullfs_create(dir, dentry, mode | S_IFREG, error);
+  nullfs_stats_meta(dir);
+  nullfs_lat_end(dir->i_sb, NULLFS_LAT_CREATE, start);
+  return error;
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0)
@@ -672,16 +4555,153 @@ static int nullfs_tmpfile(struct inode *dir, struct dentry *dentry,
 }
 #endif
 
+static struct dentry *nullfs_lookup(struct inode *dir, struct dentry *dentry,
+                                    unsigned int flags) {
+  u64 start = nullfs_lat_start(dir->i_sb);
+  struct dentry *ret = simple_lookup(dir, dentry, flags);
+
+  trace_nullfs_lookup(dir, dentry, 0, PTR_ERR_OR_ZERO(ret));
+  nullfs_stats_meta(dir);
+  nullfs_lat_end(dir->i_sb, NULLFS_LAT_LOOKUP, start);
+  return ret;
+}
+
+static int nullfs_unlink(struct inode *dir, struct dentry *dentry) {
+  u64 start = nullfs_lat_start(dir->i_sb);
+  umode_t mode = d_inode(dentry)->i_mode;
+  int error;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 1, 0)
+  nullfs_dir_remove(dir, dentry);
+#endif
+  error = simple_unlink(dir, dentry);
+  trace_nullfs_unlink(dir, dentry, mode, error);
+  nullfs_stats_meta(dir);
+  nullfs_lat_end(dir->i_sb, NULLFS_LAT_UNLINK, start);
+  return error;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 1, 0)
+static int nullfs_link(struct dentry *old_dentry, struct inode *dir,
+                       struct dentry *dentry) {
+  int error = nullfs_dir_add(dir, dentry);
+
+  if (error)
+    return error;
+  return simple_link(old_dentry, dir, dentry);
+}
+
+static int nullfs_rmdir(struct inode *dir, struct dentry *dentry) {
+  if (!simple_empty(dentry))
+    return -ENOTEMPTY;
+  nullfs_dir_remove(dir, dentry);
+  return simple_rmdir(dir, dentry);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+static int nullfs_rename(struct mnt_idmap *idmap, struct inode *old_dir,
+                         struct dentry *old_dentry, struct inode *new_dir,
+                         struct dentry *new_dentry, unsigned int flags)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+static int nullfs_rename(struct user_namespace *mnt_userns,
+                         struct inode *old_dir, struct dentry *old_dentry,
+                         struct inode *new_dir, struct dentry *new_dentry,
+                         unsigned int flags)
+#else
+static int nullfs_rename(struct inode *old_dir, struct dentry *old_dentry,
+                         struct inode *new_dir, struct dentry *new_dentry,
+                         unsigned int flags)
+#endif
+{
+  struct xarray *old_entries = &nullfs_dir(old_dir)->entries;
+  struct xarray *new_entries = &nullfs_dir(new_dir)->entries;
+  unsigned long old_cookie = (unsigned long)old_dentry->d_fsdata;
+  unsigned long new_cookie = (unsigned long)new_dentry->d_fsdata;
+  u64 start = nullfs_lat_start(old_dir->i_sb);
+  bool replace = d_really_is_positive(new_dentry);
+  u32 cookie = 0;
+  int error;
+
+  if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE))
+    return -EINVAL;
+
+  if (flags & RENAME_EXCHANGE) {
+    /**
+     * both entries keep their slots, only the dentries are swapped.
+     * Both slots are in use, so storing into them never allocates.
+     **/
+    error = xa_err(xa_store(old_entries, old_cookie, new_dentry, GFP_KERNEL));
+    if (error)
+      return error;
+    error = xa_err(xa_store(new_entries, new_cookie, old_dentry, GFP_KERNEL));
+    if (error) {
+      xa_store(old_entries, old_cookie, old_dentry, GFP_KERNEL);
+      return error;
+    }
+  } else {
+    if (!simple_empty(new_dentry))
+      return -ENOTEMPTY;
+    /* reserve the new slot, nothing else changes until the rename is done */
+    error = xa_alloc_cyclic(new_entries, &cookie, old_dentry, NULLFS_DIR_LIMIT,
+                            &nullfs_dir(new_dir)->next, GFP_KERNEL);
+    if (error < 0)
+      return error;
+  }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+  error = simple_rename(idmap, old_dir, old_dentry, new_dir, new_dentry, flags);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+  error = simple_rename(mnt_userns, old_dir, old_dentry, new_dir, new_dentry,
+                        flags);
+#else
+  error = simple_rename(old_dir, old_dentry, new_dir, new_dentry, flags);
+#endif
+
+  if (flags & RENAME_EXCHANGE) {
+    if (error) {
+      xa_store(old_entries, old_cookie, old_dentry, GFP_KERNEL);
+      xa_store(new_entries, new_cookie, new_dentry, GFP_KERNEL);
+    } else {
+      old_dentry->d_fsdata = (void *)new_cookie;
+      new_dentry->d_fsdata = (void *)old_cookie;
+    }
+  } else if (error) {
+    xa_erase(new_entries, cookie);
+  } else {
+    xa_erase(old_entries, old_cookie);
+    if (replace)
+      nullfs_dir_remove(new_dir, new_dentry);
+    old_dentry->d_fsdata = (void *)(unsigned long)cookie;
+  }
+  trace_nullfs_rename(old_dir, old_dentry, new_dir, new_dentry, flags, error);
+  nullfs_stats_meta(old_dir);
+  nullfs_lat_end(old_dir->i_sb, NULLFS_LAT_RENAME, start);
+  return error;
+}
+#endif
+
 static const struct inode_operations nullfs_dir_inode_operations = {
     .create = nullfs_create,
-    .lookup = simple_lookup,
+    .lookup = nullfs_lookup,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 1, 0)
+    .link = nullfs_link,
+#else
     .link = simple_link,
-    .unlink = simple_unlink,
+#endif
+    .unlink = nullfs_unlink,
     .symlink = nullfs_symlink,
     .mkdir = nullfs_mkdir,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 1, 0)
+    .rmdir = nullfs_rmdir,
+#else
     .rmdir = simple_rmdir,
+#endif
     .mknod = nullfs_mknod,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 1, 0)
+    .rename = nullfs_rename,
+#else
     .rename = simple_rename,
+#endif
     .getattr = nullfs_getattr,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
     .set_acl = nullfs_set_acl,
@@ -695,22 +4715,111 @@ int nullfs_statfs(struct dentry *dentry, struct kstatfs *buf) {
   /**
    * Software this is used with checks for free space
    * constantly, so we need to tell there is always free
-   * space
+   * space, unless the mount has been given a size
    *
    * Filesystem      Size  Used Avail Use% Mounted on
    * none            382G   39G  344G  10% /my
    **/
+  struct nullfs_fs_info *fsi = dentry->d_sb->s_fs_info;
+  u64 bytes = percpu_counter_sum_positive(&fsi->bytes);
+  u64 inodes = percpu_counter_sum_positive(&fsi->inodes);
+
   buf->f_type = dentry->d_sb->s_magic;
   buf->f_bsize = dentry->d_sb->s_blocksize;
-  buf->f_blocks = 100000000;
-  buf->f_bfree = 90000000;
-  buf->f_bavail = 90000000;
+  if (fsi->mount_opts.size) {
+    buf->f_blocks = fsi->mount_opts.size >> dentry->d_sb->s_blocksize_bits;
+    buf->f_bfree = buf->f_blocks -
+                   min_t(u64, buf->f_blocks,
+                         DIV_ROUND_UP_ULL(bytes, buf->f_bsize));
+  } else {
+    buf->f_blocks = 100000000;
+    buf->f_bfree = 90000000;
+  }
+  buf->f_bavail = buf->f_bfree;
+  if (fsi->mount_opts.nr_inodes) {
+    buf->f_files = fsi->mount_opts.nr_inodes;
+    buf->f_ffree = buf->f_files - min(buf->f_files, inodes);
+  } else {
+    buf->f_ffree = 90000000;
+    buf->f_files = buf->f_ffree + inodes;
+  }
   buf->f_namelen = NAME_MAX;
   return 0;
 }
 
+static struct inode *nullfs_alloc_inode(struct super_block *sb) {
+  struct nullfs_inode_info *ni;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+  ni = alloc_inode_sb(sb, nullfs_inode_cachep, GFP_KERNEL);
+#else
+  ni = kmem_cache_alloc(nullfs_inode_cachep, GFP_KERNEL);
+#endif
+  if (!ni)
+    return NULL;
+  return &ni->vfs_inode;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+static void nullfs_free_inode(struct inode *inode) {
+  nullfs_free_link(inode);
+  kmem_cache_free(nullfs_inode_cachep, NULLFS_I(inode));
+}
+#else
+static void nullfs_i_callback(struct rcu_head *head) {
+  struct inode *inode = container_of(head, struct inode, i_rcu);
+
+  nullfs_free_link(inode);
+  kmem_cache_free(nullfs_inode_cachep, NULLFS_I(inode));
+}
+
+static void nullfs_destroy_inode(struct inode *inode) {
+  call_rcu(&inode->i_rcu, nullfs_i_callback);
+}
+#endif
+
+static void nullfs_evict_inode(struct inode *inode) {
+  struct nullfs_fs_info *fsi = inode->i_sb->s_fs_info;
+
+  truncate_inode_pages_final(&inode->i_data);
+  clear_inode(inode);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 1, 0)
+  if (S_ISDIR(inode->i_mode) && nullfs_dir(inode)) {
+    xa_destroy(&nullfs_dir(inode)->entries);
+    kfree(nullfs_dir(inode));
+  }
+#endif
+  if (S_ISREG(inode->i_mode)) {
+    struct nullfs_file_ext *ext = nullfs_file_ext(inode);
+
+    percpu_counter_sub(&fsi->bytes,
+                       atomic64_read(&NULLFS_I(inode)->file.accounted));
+    if (ext) {
+      percpu_counter_sub(&fsi->keep_used, ext->charged);
+      kfree(ext->csum);
+      nullfs_extents_free(inode);
+      nullfs_stats_free(fsi, ext->stats);
+      kfree(ext);
+    }
+  }
+  percpu_counter_dec(&fsi->inodes);
+}
+
+static void nullfs_inode_init_once(void *foo) {
+  struct nullfs_inode_info *ni = foo;
+
+  inode_init_once(&ni->vfs_inode);
+}
+
 static const struct super_operations nullfs_ops = {
     .statfs = nullfs_statfs,
+    .alloc_inode = nullfs_alloc_inode,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+    .free_inode = nullfs_free_inode,
+#else
+    .destroy_inode = nullfs_destroy_inode,
+#endif
+    .evict_inode = nullfs_evict_inode,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 18, 0)
     .drop_inode = inode_just_drop,
 #else
@@ -718,6 +4827,496 @@ static const struct super_operations nullfs_ops = {
 #endif
     .show_options = nullfs_show_options};
 
+/**
+ * Namespace images
+ *
+ * With image= the tree described by a nullfsvfs_image.h image is built
+ * while mounting, before the file system is visible to anybody. Entries
+ * are created straight into the dcache without going through lookup,
+ * permission checks or the inode lock, which makes loading millions of
+ * files a matter of seconds. The image is read sequentially through a
+ * small buffer, only the dentries of the directories are remembered.
+ **/
+#define NULLFS_IMAGE_BUF (64 * 1024)
+
+/* directories by number, the image root or the ioctl directory is 0 */
+struct nullfs_dirtab {
+  struct dentry **d;
+  u32 nr;
+  u32 max;
+};
+
+static int nullfs_dirtab_add(struct nullfs_dirtab *t, struct dentry *dentry) {
+  if (t->nr == t->max) {
+    u32 max = t->max ? t->max * 2 : 1024;
+    struct dentry **d;
+
+    if (max <= t->max)
+      return -EFBIG;
+    d = vmalloc(sizeof(*d) * (size_t)max);
+    if (!d)
+      return -ENOMEM;
+    if (t->nr)
+      memcpy(d, t->d, sizeof(*d) * t->nr);
+    vfree(t->d);
+    t->d = d;
+    t->max = max;
+  }
+  t->d[t->nr++] = dentry;
+  return 0;
+}
+
+struct nullfs_image {
+  struct file *file;
+  loff_t pos;
+  char *buf;
+  size_t len;
+  size_t off;
+  char *target; /* PATH_MAX bytes for symlink targets */
+  struct nullfs_dirtab dirs;
+};
+
+static int nullfs_image_read(struct nullfs_image *img, void *dst, size_t len) {
+  char *p = dst;
+  ssize_t n;
+
+  while (len) {
+    if (img->off == img->len) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+      n = kernel_read(img->file, img->buf, NULLFS_IMAGE_BUF, &img->pos);
+#else
+      n = kernel_read(img->file, img->pos, img->buf, NULLFS_IMAGE_BUF);
+      if (n > 0)
+        img->pos += n;
+#endif
+      if (n < 0)
+        return n;
+      if (!n)
+        return p == dst ? -ENODATA : -EINVAL;
+      img->len = n;
+      img->off = 0;
+    }
+    n = min(len, img->len - img->off);
+    memcpy(p, img->buf + img->off, n);
+    img->off += n;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+
+static bool nullfs_image_mode_ok(u32 mode) {
+  if (mode & ~(S_IFMT | S_IALLUGO))
+    return false;
+  switch (mode & S_IFMT) {
+  case S_IFREG:
+  case S_IFDIR:
+  case S_IFLNK:
+  case S_IFCHR:
+  case S_IFBLK:
+  case S_IFIFO:
+  case S_IFSOCK:
+    return true;
+  }
+  return false;
+}
+
+static int nullfs_image_entry(struct super_block *sb, struct nullfs_image *img,
+                              const struct nullfs_image_entry *e,
+                              const char *name) {
+  u32 mode = le32_to_cpu(e->mode);
+  u64 size = le64_to_cpu(e->size);
+  struct dentry *parent;
+  struct dentry *dentry;
+  struct inode *inode;
+  struct qstr q = QSTR_INIT(name, le16_to_cpu(e->namelen));
+  kuid_t uid;
+  kgid_t gid;
+  int err;
+
+  parent = img->dirs.d[le32_to_cpu(e->parent)];
+  dentry = d_hash_and_lookup(parent, &q);
+  if (IS_ERR(dentry))
+    return PTR_ERR(dentry);
+  if (dentry) {
+    dput(dentry);
+    return -EEXIST;
+  }
+
+  dentry = d_alloc_name(parent, name);
+  if (!dentry)
+    return -ENOMEM;
+  inode = nullfs_get_inode(sb, d_inode(parent), mode,
+                           new_decode_dev(le32_to_cpu(e->rdev)), dentry);
+  if (!inode) {
+    dput(dentry);
+    return -ENOSPC;
+  }
+
+  uid = make_kuid(current_user_ns(), le32_to_cpu(e->uid));
+  gid = make_kgid(current_user_ns(), le32_to_cpu(e->gid));
+  if (uid_valid(uid))
+    inode->i_uid = uid;
+  if (gid_valid(gid))
+    inode->i_gid = gid;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+  inode_set_mtime(inode, le64_to_cpu(e->mtime), 0);
+#else
+  inode->i_mtime.tv_sec = le64_to_cpu(e->mtime);
+  inode->i_mtime.tv_nsec = 0;
+#endif
+
+  err = 0;
+  switch (mode & S_IFMT) {
+  case S_IFREG:
+    if (size > sb->s_maxbytes)
+      err = -EFBIG;
+    else if (nullfs_over_size(inode, size))
+      err = -ENOSPC;
+    if (err)
+      break;
+    i_size_write(inode, size);
+    nullfs_size_sync(inode);
+    break;
+  case S_IFLNK:
+    err = nullfs_image_read(img, img->target, size);
+    if (err)
+      break;
+    img->target[size] = '\0';
+    err = strlen(img->target) == size ? nullfs_set_link(inode, img->target)
+                                       : -EINVAL;
+    break;
+  case S_IFDIR:
+    inode->i_size = PAGE_SIZE;
+    err = nullfs_dirtab_add(&img->dirs, dentry);
+    break;
+  }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 1, 0)
+  if (!err)
+    err = nullfs_dir_add(d_inode(parent), dentry);
+#endif
+  if (err) {
+    iput(inode);
+    dput(dentry);
+    return err;
+  }
+  if (S_ISDIR(mode))
+    inc_nlink(d_inode(parent));
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 19, 0)
+  d_make_persistent(dentry, inode);
+  d_rehash(dentry);
+  dput(dentry);
+#else
+  d_add(dentry, inode); /* the reference from d_alloc pins the dentry */
+#endif
+  return 0;
+}
+
+static int nullfs_image_load(struct super_block *sb, const char *path) {
+  struct nullfs_image img = {};
+  struct nullfs_image_header hdr;
+  struct nullfs_image_entry e;
+  char name[NAME_MAX + 1];
+  u64 nr = 0;
+  u16 len;
+  int err;
+
+  img.file = filp_open(path, O_RDONLY, 0);
+  if (IS_ERR(img.file)) {
+    printk(KERN_ERR "nullfsvfs: cannot open image %s\n", path);
+    return PTR_ERR(img.file);
+  }
+  img.buf = vmalloc(NULLFS_IMAGE_BUF);
+  img.target = kmalloc(PATH_MAX, GFP_KERNEL);
+  err = -ENOMEM;
+  if (!img.buf || !img.target)
+    goto out;
+  err = nullfs_dirtab_add(&img.dirs, sb->s_root);
+  if (err)
+    goto out;
+
+  err = nullfs_image_read(&img, &hdr, sizeof(hdr));
+  if (!err && (memcmp(hdr.magic, NULLFS_IMAGE_MAGIC, sizeof(hdr.magic)) ||
+               le32_to_cpu(hdr.version) != NULLFS_IMAGE_VERSION ||
+               hdr.flags))
+    err = -EINVAL;
+  if (err) {
+    printk(KERN_ERR "nullfsvfs: %s is not a nullfsvfs image\n", path);
+    goto out;
+  }
+
+  for (;;) {
+    err = nullfs_image_read(&img, &e, sizeof(e));
+    if (err == -ENODATA) {
+      err = 0;
+      break;
+    }
+    if (err)
+      break;
+    len = le16_to_cpu(e.namelen);
+    err = -EINVAL;
+    if (!len || len > NAME_MAX || le32_to_cpu(e.parent) >= img.dirs.nr ||
+        !nullfs_image_mode_ok(le32_to_cpu(e.mode)) ||
+        (S_ISLNK(le32_to_cpu(e.mode)) &&
+         (!le64_to_cpu(e.size) || le64_to_cpu(e.size) >= PATH_MAX)))
+      break;
+    err = nullfs_image_read(&img, name, len);
+    if (err)
+      break;
+    name[len] = '\0';
+    err = -EINVAL;
+    if (strlen(name) != len || strchr(name, '/') || !strcmp(name, ".") ||
+        !strcmp(name, ".."))
+      break;
+    err = nullfs_image_entry(sb, &img, &e, name);
+    if (err)
+      break;
+    nr++;
+    cond_resched();
+  }
+
+  if (err)
+    printk(KERN_ERR "nullfsvfs: image %s: entry %llu: error %d\n", path, nr,
+           err);
+  else
+    printk(KERN_INFO "nullfsvfs: loaded %llu entries from image %s\n", nr,
+           path);
+out:
+  vfree(img.dirs.d);
+  kfree(img.target);
+  vfree(img.buf);
+  filp_close(img.file, NULL);
+  return err;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 1, 0)
+/**
+ * NULLFS_IOC_BATCH
+ *
+ * Creates a list of entries in image format below a directory with a
+ * single ioctl. Entries are copied in one at a time and created with
+ * vfs_mknod(), vfs_mkdir() and vfs_symlink(), so permissions, dead
+ * directories, S_ISGID stripping, LSM hooks and fsnotify events are
+ * handled like for the system calls. There is no path walk, and the
+ * parent is locked only once for every run of entries that go into the
+ * same directory. Errors of single entries are reported in the errors
+ * array, a malformed buffer stops the batch.
+ **/
+static struct dentry *nullfs_batch_create(struct file *file, struct inode *dir,
+                                          struct dentry *dentry, umode_t mode,
+                                          dev_t dev, const char *target) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+  struct mnt_idmap *idmap = file_mnt_idmap(file);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+  struct user_namespace *mnt_userns = file_mnt_user_ns(file);
+#endif
+  int err;
+
+  /* from 6.15 on vfs_mkdir() drops the dentry itself on failure */
+  if (S_ISDIR(mode)) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 19, 0)
+    return vfs_mkdir(idmap, dir, dentry, mode, NULL);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+    return vfs_mkdir(idmap, dir, dentry, mode);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    err = vfs_mkdir(idmap, dir, dentry, mode);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+    err = vfs_mkdir(mnt_userns, dir, dentry, mode);
+#else
+    err = vfs_mkdir(dir, dentry, mode);
+#endif
+  } else if (S_ISLNK(mode)) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 19, 0)
+    err = vfs_symlink(idmap, dir, dentry, target, NULL);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    err = vfs_symlink(idmap, dir, dentry, target);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+    err = vfs_symlink(mnt_userns, dir, dentry, target);
+#else
+    err = vfs_symlink(dir, dentry, target);
+#endif
+  } else {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 19, 0)
+    err = vfs_mknod(idmap, dir, dentry, mode, dev, NULL);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    err = vfs_mknod(idmap, dir, dentry, mode, dev);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+    err = vfs_mknod(mnt_userns, dir, dentry, mode, dev);
+#else
+    err = vfs_mknod(dir, dentry, mode, dev);
+#endif
+  }
+  if (err) {
+    dput(dentry);
+    return ERR_PTR(err);
+  }
+  return dentry;
+}
+
+static struct dentry *nullfs_batch_entry(struct file *file,
+                                         struct dentry *parent,
+                                         const struct nullfs_image_entry *e,
+                                         const char *name, const char *target) {
+  struct inode *dir = d_inode(parent);
+  u32 mode = le32_to_cpu(e->mode);
+  u64 size = le64_to_cpu(e->size);
+  dev_t dev = new_decode_dev(le32_to_cpu(e->rdev));
+  struct dentry *dentry;
+
+  if (!nullfs_image_mode_ok(mode) || strlen(name) != le16_to_cpu(e->namelen) ||
+      strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, ".."))
+    return ERR_PTR(-EINVAL);
+  if (S_ISREG(mode) && size > dir->i_sb->s_maxbytes)
+    return ERR_PTR(-EFBIG);
+  if (S_ISREG(mode) && nullfs_over_size(dir, size))
+    return ERR_PTR(-ENOSPC);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 16, 0)
+  dentry = lookup_noperm(&QSTR_LEN(name, le16_to_cpu(e->namelen)), parent);
+#else
+  dentry = lookup_one_len(name, parent, le16_to_cpu(e->namelen));
+#endif
+  if (IS_ERR(dentry))
+    return dentry;
+  if (d_really_is_positive(dentry)) {
+    dput(dentry);
+    return ERR_PTR(-EEXIST);
+  }
+
+  dentry = nullfs_batch_create(file, dir, dentry, mode, dev, target);
+  if (!IS_ERR(dentry) && S_ISREG(mode)) {
+    i_size_write(d_inode(dentry), size);
+    nullfs_size_sync(d_inode(dentry));
+  }
+  return dentry;
+}
+
+static long nullfs_batch(struct file *file, struct nullfs_batch __user *arg) {
+  struct nullfs_dirtab dirs = {};
+  struct dentry *locked = NULL;
+  struct nullfs_image_entry e;
+  char name[NAME_MAX + 1];
+  struct nullfs_batch b;
+  const char __user *p;
+  s32 __user *errors;
+  struct dentry *dentry;
+  long created = 0;
+  char *target;
+  size_t left;
+  u64 tlen;
+  int err;
+  u32 i;
+  u16 len;
+
+  if (copy_from_user(&b, arg, sizeof(b)))
+    return -EFAULT;
+  if (b.flags || b.reserved)
+    return -EINVAL;
+  p = u64_to_user_ptr(b.buf);
+  left = b.len;
+  errors = u64_to_user_ptr(b.errors);
+
+  target = kmalloc(PATH_MAX, GFP_KERNEL);
+  if (!target)
+    return -ENOMEM;
+  err = mnt_want_write_file(file);
+  if (err)
+    goto out_free;
+  err = nullfs_dirtab_add(&dirs, dget(file->f_path.dentry));
+  if (err) {
+    dput(file->f_path.dentry);
+    goto out;
+  }
+
+  for (i = 0; left; i++) {
+    err = -EINVAL;
+    if (left < sizeof(e))
+      break;
+    err = -EFAULT;
+    if (copy_from_user(&e, p, sizeof(e)))
+      break;
+    len = le16_to_cpu(e.namelen);
+    tlen = S_ISLNK(le32_to_cpu(e.mode)) ? le64_to_cpu(e.size) : 0;
+    err = -EINVAL;
+    if (!len || len > NAME_MAX || (S_ISLNK(le32_to_cpu(e.mode)) && !tlen) ||
+        tlen >= PATH_MAX || left - sizeof(e) < len + tlen ||
+        le32_to_cpu(e.parent) >= dirs.nr)
+      break;
+    err = -EFAULT;
+    if (copy_from_user(name, p + sizeof(e), len) ||
+        copy_from_user(target, p + sizeof(e) + len, tlen))
+      break;
+    name[len] = '\0';
+    target[tlen] = '\0';
+    p += sizeof(e) + len + tlen;
+    left -= sizeof(e) + len + tlen;
+
+    /* entries below a directory that failed fail as well */
+    dentry = dirs.d[le32_to_cpu(e.parent)];
+    if (dentry && dentry != locked) {
+      if (locked)
+        inode_unlock(d_inode(locked));
+      locked = dentry;
+      inode_lock_nested(d_inode(locked), I_MUTEX_PARENT);
+    }
+    if (!dentry)
+      dentry = ERR_PTR(-ENOENT);
+    else
+      dentry = nullfs_batch_entry(file, locked, &e, name, target);
+
+    err = PTR_ERR_OR_ZERO(dentry);
+    if (errors && put_user(err, errors + i)) {
+      err = -EFAULT;
+      if (!IS_ERR(dentry))
+        dput(dentry);
+      break;
+    }
+    if (!IS_ERR(dentry))
+      created++;
+    if (S_ISDIR(le32_to_cpu(e.mode))) {
+      err = nullfs_dirtab_add(&dirs, IS_ERR(dentry) ? NULL : dentry);
+      if (err) {
+        if (!IS_ERR(dentry))
+          dput(dentry);
+        break;
+      }
+    } else if (!IS_ERR(dentry)) {
+      dput(dentry);
+    }
+    err = 0;
+
+    if (fatal_signal_pending(current)) {
+      err = -EINTR;
+      break;
+    }
+    cond_resched();
+  }
+
+  if (locked)
+    inode_unlock(d_inode(locked));
+  for (i = 0; i < dirs.nr; i++)
+    dput(dirs.d[i]);
+out:
+  vfree(dirs.d);
+  mnt_drop_write_file(file);
+out_free:
+  kfree(target);
+  /* like a short write, the error only counts if nothing was created */
+  return created ? created : err;
+}
+
+static long nullfs_dir_ioctl(struct file *file, unsigned int cmd,
+                             unsigned long arg) {
+  switch (cmd) {
+  case NULLFS_IOC_BATCH:
+    return nullfs_batch(file, (struct nullfs_batch __user *)arg);
+  }
+  return -ENOTTY;
+}
+#endif
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(7, 0, 0)
 static int nullfs_fill_super(struct super_block *sb, struct fs_context *fc)
 #else
@@ -725,10 +5324,10 @@ int nullfs_fill_super(struct super_block *sb, void *data, int silent)
 #endif
 {
   struct inode *inode;
+  int err;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(7, 0, 0)
   struct nullfs_fs_info *fsi;
-  int err;
   fsi = kzalloc(sizeof(struct nullfs_fs_info), GFP_KERNEL);
   sb->s_fs_info = fsi;
 #else
@@ -743,6 +5342,54 @@ int nullfs_fill_super(struct super_block *sb, void *data, int silent)
   if (err)
     return err;
 #endif
+  err = nullfs_check_writeback(&fsi->mount_opts);
+  if (err)
+    return err;
+
+  if (fsi->mount_opts.write) {
+    struct nullfs_patterns *keep;
+
+    keep = nullfs_patterns_compile(fsi->mount_opts.write);
+    if (IS_ERR(keep))
+      return PTR_ERR(keep);
+    RCU_INIT_POINTER(fsi->keep, keep);
+    printk(KERN_INFO "nullfsvfs: will keep data for files matching: [%s]\n",
+           fsi->mount_opts.write);
+    kfree(fsi->mount_opts.write);
+    fsi->mount_opts.write = NULL;
+  }
+
+  err = nullfs_bucket_init(&fsi->bw, fsi->mount_opts.bw);
+  if (!err)
+    err = nullfs_bucket_init(&fsi->iops, fsi->mount_opts.iops);
+  if (!err)
+    err = percpu_counter_init(&fsi->inodes, 0, GFP_KERNEL);
+  if (!err)
+    err = percpu_counter_init(&fsi->keep_used, 0, GFP_KERNEL);
+  if (!err)
+    err = percpu_counter_init(&fsi->bytes, 0, GFP_KERNEL);
+  if (err)
+    return err;
+  fsi->ino_batch = alloc_percpu(u64);
+  if (!fsi->ino_batch)
+    return -ENOMEM;
+  if (fsi->mount_opts.stats) {
+    fsi->stats_top = NULLFS_STATS_TOP;
+    mutex_init(&fsi->stats_lock);
+    INIT_LIST_HEAD(&fsi->stats_files);
+    fsi->pid_stats = alloc_percpu(struct nullfs_pid_table);
+    if (!fsi->pid_stats)
+      return -ENOMEM;
+  }
+#if NULLFS_HAVE_WRITEBACK
+  /* a bdi of its own brings dirty accounting and flusher threads */
+  if (fsi->mount_opts.cache == NULLFS_CACHE_WRITEBACK) {
+    err = super_setup_bdi_name(sb, "nullfsvfs-%u:%u", MAJOR(sb->s_dev),
+                               MINOR(sb->s_dev));
+    if (err)
+      return err;
+  }
+#endif
 
   sb->s_maxbytes = MAX_LFS_FILESIZE;
   sb->s_blocksize = PAGE_SIZE;
@@ -767,19 +5414,36 @@ int nullfs_fill_super(struct super_block *sb, void *data, int silent)
   if (!sb->s_root)
     return -ENOMEM;
 
-  return 0;
+  if (fsi->mount_opts.image) {
+    err = nullfs_image_load(sb, fsi->mount_opts.image);
+    kfree(fsi->mount_opts.image);
+    fsi->mount_opts.image = NULL;
+    if (err)
+      return err;
+  }
+
+  err = nullfs_sysfs_register(sb);
+  if (!err)
+    nullfs_debugfs_register(sb);
+  return err;
 }
 
 /**
  * setup / register and destroy filesystem
  **/
 static void nullfs_kill_sb(struct super_block *sb) {
-  kfree(sb->s_fs_info);
+  struct nullfs_fs_info *fsi = sb->s_fs_info;
+
+  if (fsi) {
+    nullfs_debugfs_unregister(fsi);
+    nullfs_sysfs_unregister(fsi);
+  }
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 19, 0)
   kill_anon_super(sb);
 #else
   kill_litter_super(sb);
 #endif
+  nullfs_free_fsi(fsi);
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 18, 0)
@@ -843,22 +5507,57 @@ static struct file_system_type nullfs_type = {
 
 static int __init nullfs_init(void) {
   int retval;
-  exclude_kobj = kobject_create_and_add("nullfsvfs", fs_kobj);
-  if (!exclude_kobj)
+
+  nullfs_inode_cachep = kmem_cache_create(
+      "nullfs_inode_cache", sizeof(struct nullfs_inode_info), 0,
+      SLAB_RECLAIM_ACCOUNT | SLAB_ACCOUNT, nullfs_inode_init_once);
+  if (!nullfs_inode_cachep)
     return -ENOMEM;
 
+  retval = nullfs_pattern_init();
+  if (retval)
+    goto out_cache;
+#if NULLFS_HAVE_WRITEBACK
+  nullfs_wb_init();
+#endif
+
+  exclude_kobj = kobject_create_and_add("nullfsvfs", fs_kobj);
+  if (!exclude_kobj) {
+    retval = -ENOMEM;
+    goto out_pattern;
+  }
+
   retval = sysfs_create_group(exclude_kobj, &attr_group);
   if (retval)
-    kobject_put(exclude_kobj);
+    goto out_kobj;
 
-  register_filesystem(&nullfs_type);
+  nullfs_debugfs_root = debugfs_create_dir("nullfsvfs", NULL);
+  retval = register_filesystem(&nullfs_type);
+  if (retval)
+    goto out_debugfs;
   printk(KERN_INFO "nullfsvfs: version [%s] initialized\n", NULLFS_VERSION);
   return 0;
+
+out_debugfs:
+  debugfs_remove_recursive(nullfs_debugfs_root);
+out_kobj:
+  kobject_put(exclude_kobj);
+out_pattern:
+  nullfs_pattern_exit();
+out_cache:
+  kmem_cache_destroy(nullfs_inode_cachep);
+  return retval;
 }
 
 static void __exit nullfs_exit(void) {
   kobject_put(exclude_kobj);
   unregister_filesystem(&nullfs_type);
+  debugfs_remove_recursive(nullfs_debugfs_root);
+  /* make sure all delayed rcu free inodes and pattern sets are gone */
+  rcu_barrier();
+  nullfs_patterns_free(rcu_dereference_protected(nullfs_exclude, 1));
+  nullfs_pattern_exit();
+  kmem_cache_destroy(nullfs_inode_cachep);
 }
 
 module_init(nullfs_init);
@@ -0,0 +1,76 @@
+/*
+ *   nullfsvfs namespace image format
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *
+ *
+ * An image describes a tree of directories, files, symlinks and special
+ * files without any file data. It is loaded with the image= mount option
+ * and written by bench/nullfs-image. The format is read strictly in
+ * order, so images can be streamed and never need to fit into memory:
+ *
+ *   struct nullfs_image_header
+ *   struct nullfs_image_entry, followed by namelen bytes of name and,
+ *     for symlinks, size bytes of target (neither is NUL terminated)
+ *   ... until the end of the file
+ *
+ * Directories are numbered in the order they appear, the root is 0, and
+ * every entry refers to its directory by that number, so a directory
+ * has to come before its contents. All fields are little endian.
+ *
+ * The NULLFS_IOC_BATCH ioctl takes a buffer of the same entries, without
+ * the header, and creates them below the directory it is issued on. That
+ * directory is 0, the directories created by the batch count from 1.
+ * uid, gid and mtime are ignored, the entries belong to the caller.
+ */
+#ifndef _NULLFSVFS_IMAGE_H
+#define _NULLFSVFS_IMAGE_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define NULLFS_IMAGE_MAGIC "NULLFSIM"
+#define NULLFS_IMAGE_VERSION 1
+
+struct nullfs_image_header {
+  char magic[8]; /* NULLFS_IMAGE_MAGIC, not NUL terminated */
+  __le32 version;
+  __le32 flags; /* none defined yet, must be 0 */
+};
+
+struct nullfs_image_entry {
+  __le32 parent; /* number of the directory the entry lives in */
+  __le32 mode;   /* file type and permissions */
+  __le32 uid;
+  __le32 gid;
+  __le32 rdev;    /* device number of special files, new_encode_dev() */
+  __le16 namelen; /* 1 to 255 */
+  __le16 reserved;
+  __le64 size;  /* file size, target length for symlinks */
+  __le64 mtime; /* seconds since the epoch */
+};
+
+struct nullfs_batch {
+  __u64 buf;    /* entries */
+  __u64 len;    /* size of buf in bytes */
+  __u64 errors; /* optional, a __s32 per entry: 0 or -errno */
+  __u32 flags;  /* none defined yet, must be 0 */
+  __u32 reserved;
+};
+
+/* returns the number of entries created, an error only if there are none */
+#define NULLFS_IOC_BATCH _IOW('N', 0x80, struct nullfs_batch)
+
+#endif /* _NULLFSVFS_IMAGE_H */
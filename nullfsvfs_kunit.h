@@ -0,0 +1,49 @@
+/*
+ *   nullfsvfs KUnit hooks
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *
+ *
+ * Functions exercised by nullfsvfs_test.ko. With KUnit enabled they are
+ * exported in the EXPORTED_FOR_KUNIT_TESTING namespace, otherwise they
+ * stay static to nullfsvfs.c.
+ */
+#ifndef _NULLFSVFS_KUNIT_H
+#define _NULLFSVFS_KUNIT_H
+
+#include <linux/fs.h>
+#include <linux/version.h>
+
+#if IS_ENABLED(CONFIG_KUNIT) && LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+#define NULLFS_KUNIT 1
+#include <kunit/visibility.h>
+
+struct nullfs_patterns;
+
+struct nullfs_patterns *nullfs_patterns_compile(const char *source);
+bool nullfs_patterns_match(const struct nullfs_patterns *set,
+                           const struct qstr *name);
+void nullfs_patterns_free(struct nullfs_patterns *set);
+ssize_t nullfs_grow_size(struct inode *inode, loff_t *pos, size_t count,
+                         bool append, loff_t *prev);
+size_t nullfs_read_count(struct inode *inode, loff_t pos, size_t count);
+struct inode *nullfs_get_inode(struct super_block *sb, const struct inode *dir,
+                               umode_t mode, dev_t dev, struct dentry *dentry);
+#else
+#define VISIBLE_IF_KUNIT static
+#define EXPORT_SYMBOL_IF_KUNIT(symbol)
+#endif
+
+#endif /* _NULLFSVFS_KUNIT_H */
@@ -0,0 +1,624 @@
+/*
+ *   nullfsvfs KUnit tests.
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *
+ *
+ * Checks the size and EOF handling of the write and read paths and times
+ * the hot functions of nullfsvfs.c on an internal mount, without going
+ * through the VFS: the static inode and file operations are called
+ * through the operation tables of the inodes and files they set up.
+ * Every timed test runs the same loop with 1, 2, 4 and 8 threads and
+ * reports ns per call:
+ *
+ *  # insmod nullfsvfs.ko && insmod nullfsvfs_test.ko iters=100000
+ *  # dmesg | grep -e nullfsvfs -e ok
+ */
+#include <linux/completion.h>
+#include <linux/cred.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/mount.h>
+#include <linux/slab.h>
+#include <linux/stat.h>
+#include <linux/version.h>
+
+#include "nullfsvfs_kunit.h"
+
+#ifdef NULLFS_KUNIT
+#include <kunit/test.h>
+
+static unsigned int iters = 20000;
+module_param(iters, uint, 0444);
+MODULE_PARM_DESC(iters, "loop iterations per thread for the timed tests");
+
+static const unsigned int nullfs_threads[] = {1, 2, 4, 8};
+
+struct nullfs_test_worker;
+
+struct nullfs_test_ctx {
+  struct vfsmount *mnt;
+  struct super_block *sb;
+  struct inode *inode;          /* file of the size and append tests */
+  struct dentry *dentry;        /* file opened by the I/O tests */
+  struct file *file;
+  struct nullfs_patterns *keep; /* compiled by the keep_match test */
+  char *buf;
+  bool (*fn)(struct nullfs_test_worker *w, unsigned int i);
+  bool unlink; /* fn creates an entry per call, removed after timing */
+  atomic_t errors;
+};
+
+struct nullfs_test_worker {
+  struct nullfs_test_ctx *ctx;
+  struct task_struct *task;
+  struct completion done;
+  unsigned int idx;
+  struct dentry **dentries;
+};
+
+static int nullfs_test_thread(void *data) {
+  struct nullfs_test_worker *w = data;
+  unsigned int i;
+
+  for (i = 0; i < iters; i++) {
+    if (!w->ctx->fn(w, i))
+      atomic_inc(&w->ctx->errors);
+    if (!(i & 1023))
+      cond_resched();
+  }
+  complete(&w->done);
+
+  /* kthread_stop() wants the thread to still be around */
+  set_current_state(TASK_INTERRUPTIBLE);
+  while (!kthread_should_stop()) {
+    schedule();
+    set_current_state(TASK_INTERRUPTIBLE);
+  }
+  __set_current_state(TASK_RUNNING);
+  return 0;
+}
+
+/**
+ * call ->mknod and ->unlink with the parent locked, like vfs_mknod() and
+ * vfs_unlink() do. The dentries are never hashed, nothing looks them up.
+ **/
+static struct dentry *nullfs_test_create(struct nullfs_test_ctx *ctx,
+                                         const char *name, umode_t mode) {
+  struct dentry *root = ctx->mnt->mnt_root;
+  struct inode *dir = d_inode(root);
+  struct dentry *dentry;
+  int err;
+
+  dentry = d_alloc_name(root, name);
+  if (!dentry)
+    return ERR_PTR(-ENOMEM);
+  inode_lock(dir);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+  err = dir->i_op->mknod(&nop_mnt_idmap, dir, dentry, mode, 0);
+#else
+  err = dir->i_op->mknod(&init_user_ns, dir, dentry, mode, 0);
+#endif
+  inode_unlock(dir);
+  if (err) {
+    dput(dentry);
+    return ERR_PTR(err);
+  }
+  return dentry;
+}
+
+static void nullfs_test_unlink(struct dentry *dentry) {
+  struct inode *dir = d_inode(dentry->d_parent);
+
+  inode_lock(dir);
+  dir->i_op->unlink(dir, dentry);
+  inode_unlock(dir);
+  dput(dentry);
+}
+
+static int nullfs_test_stat(struct file *file, struct kstat *stat) {
+  struct inode *inode = file_inode(file);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+  return inode->i_op->getattr(&nop_mnt_idmap, &file->f_path, stat,
+                              STATX_BASIC_STATS, AT_STATX_SYNC_AS_STAT);
+#else
+  return inode->i_op->getattr(&init_user_ns, &file->f_path, stat,
+                              STATX_BASIC_STATS, AT_STATX_SYNC_AS_STAT);
+#endif
+}
+
+/* f_op->write and f_op->read are write_null and read_null */
+static ssize_t nullfs_test_pwrite(struct nullfs_test_ctx *ctx, size_t count,
+                                  loff_t *pos) {
+  return ctx->file->f_op->write(ctx->file, (const char __user *)ctx->buf,
+                                count, pos);
+}
+
+static ssize_t nullfs_test_pread(struct nullfs_test_ctx *ctx, size_t count,
+                                 loff_t *pos) {
+  return ctx->file->f_op->read(ctx->file, (char __user *)ctx->buf, count,
+                               pos);
+}
+
+/**
+ * run fn iters times in each of nthreads kernel threads, which are all
+ * created first and then started together
+ **/
+static void nullfs_test_run(struct kunit *test, const char *name,
+                            unsigned int nthreads) {
+  struct nullfs_test_ctx *ctx = test->priv;
+  struct nullfs_test_worker *w;
+  u64 calls = (u64)iters * nthreads;
+  unsigned int i;
+  ktime_t start;
+  int err = 0;
+  u64 ns;
+
+  w = kunit_kcalloc(test, nthreads, sizeof(*w), GFP_KERNEL);
+  KUNIT_ASSERT_NOT_NULL(test, w);
+
+  atomic_set(&ctx->errors, 0);
+  for (i = 0; i < nthreads; i++) {
+    w[i].ctx = ctx;
+    w[i].idx = i;
+    init_completion(&w[i].done);
+    if (ctx->unlink) {
+      w[i].dentries = kvcalloc(iters, sizeof(*w[i].dentries), GFP_KERNEL);
+      if (!w[i].dentries) {
+        err = -ENOMEM;
+        nthreads = i;
+        break;
+      }
+    }
+    w[i].task = kthread_create(nullfs_test_thread, &w[i], "nullfs-test/%u", i);
+    if (IS_ERR(w[i].task)) {
+      err = PTR_ERR(w[i].task);
+      kvfree(w[i].dentries);
+      nthreads = i;
+      break;
+    }
+    get_task_struct(w[i].task);
+  }
+
+  start = ktime_get();
+  for (i = 0; i < nthreads; i++)
+    wake_up_process(w[i].task);
+  for (i = 0; i < nthreads; i++)
+    wait_for_completion(&w[i].done);
+  ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+  for (i = 0; i < nthreads; i++) {
+    kthread_stop(w[i].task);
+    put_task_struct(w[i].task);
+  }
+  for (i = 0; i < nthreads && ctx->unlink; i++) {
+    unsigned int n;
+
+    for (n = 0; n < iters; n++)
+      if (!IS_ERR_OR_NULL(w[i].dentries[n]))
+        nullfs_test_unlink(w[i].dentries[n]);
+    kvfree(w[i].dentries);
+  }
+  KUNIT_ASSERT_EQ(test, err, 0);
+
+  kunit_info(test, "%s-t%u: %llu calls, %llu ns/call, %llu calls/s\n", name,
+             nthreads, calls, div64_u64(ns * nthreads, calls),
+             ns ? div64_u64(calls * NSEC_PER_SEC, ns) : 0);
+  KUNIT_EXPECT_EQ(test, atomic_read(&ctx->errors), 0);
+}
+
+/* a regular file in the root directory, opened read/write */
+static struct file *nullfs_test_open(struct kunit *test, const char *name,
+                                     int flags) {
+  struct nullfs_test_ctx *ctx = test->priv;
+  struct path path = {.mnt = ctx->mnt};
+  struct dentry *dentry;
+  struct file *file;
+
+  dentry = nullfs_test_create(ctx, name, S_IFREG | 0644);
+  KUNIT_ASSERT_FALSE(test, IS_ERR(dentry));
+  ctx->dentry = dentry;
+  path.dentry = dentry;
+  file = dentry_open(&path, O_RDWR | O_LARGEFILE | flags, current_cred());
+  KUNIT_ASSERT_FALSE(test, IS_ERR(file));
+  KUNIT_ASSERT_NOT_NULL(test, file->f_op->write);
+  KUNIT_ASSERT_NOT_NULL(test, file->f_op->read);
+  ctx->file = file;
+  return file;
+}
+
+static struct inode *nullfs_test_inode(struct kunit *test) {
+  struct nullfs_test_ctx *ctx = test->priv;
+  struct inode *inode;
+
+  inode = nullfs_get_inode(ctx->sb, NULL, S_IFREG | 0644, 0, NULL);
+  KUNIT_ASSERT_NOT_NULL(test, inode);
+  ctx->inode = inode;
+  return inode;
+}
+
+static void nullfs_test_size(struct kunit *test) {
+  struct inode *inode = nullfs_test_inode(test);
+  loff_t maxbytes = inode->i_sb->s_maxbytes;
+  loff_t pos = 0, prev;
+
+  /* writes grow the file, writes inside of it don't */
+  KUNIT_EXPECT_EQ(test, nullfs_grow_size(inode, &pos, 4096, false, &prev),
+                  (ssize_t)4096);
+  KUNIT_EXPECT_EQ(test, prev, (loff_t)0);
+  KUNIT_EXPECT_EQ(test, pos, (loff_t)4096);
+  KUNIT_EXPECT_EQ(test, i_size_read(inode), (loff_t)4096);
+
+  pos = 1024;
+  KUNIT_EXPECT_EQ(test, nullfs_grow_size(inode, &pos, 1024, false, &prev),
+                  (ssize_t)1024);
+  KUNIT_EXPECT_EQ(test, prev, (loff_t)4096);
+  KUNIT_EXPECT_EQ(test, pos, (loff_t)2048);
+  KUNIT_EXPECT_EQ(test, i_size_read(inode), (loff_t)4096);
+
+  /* a write beyond EOF leaves a hole */
+  pos = 8192;
+  KUNIT_EXPECT_EQ(test, nullfs_grow_size(inode, &pos, 100, false, &prev),
+                  (ssize_t)100);
+  KUNIT_EXPECT_EQ(test, i_size_read(inode), (loff_t)8292);
+
+  /* append starts at EOF, wherever pos points */
+  pos = 0;
+  KUNIT_EXPECT_EQ(test, nullfs_grow_size(inode, &pos, 8, true, &prev),
+                  (ssize_t)8);
+  KUNIT_EXPECT_EQ(test, prev, (loff_t)8292);
+  KUNIT_EXPECT_EQ(test, pos, (loff_t)8300);
+  KUNIT_EXPECT_EQ(test, i_size_read(inode), (loff_t)8300);
+
+  pos = 0;
+  KUNIT_EXPECT_EQ(test, nullfs_grow_size(inode, &pos, 0, false, &prev),
+                  (ssize_t)0);
+  KUNIT_EXPECT_EQ(test, i_size_read(inode), (loff_t)8300);
+
+  /* reads stop at EOF */
+  KUNIT_EXPECT_EQ(test, nullfs_read_count(inode, 0, 4096), (size_t)4096);
+  KUNIT_EXPECT_EQ(test, nullfs_read_count(inode, 8000, 4096), (size_t)300);
+  KUNIT_EXPECT_EQ(test, nullfs_read_count(inode, 8299, 4096), (size_t)1);
+  KUNIT_EXPECT_EQ(test, nullfs_read_count(inode, 8300, 4096), (size_t)0);
+  KUNIT_EXPECT_EQ(test, nullfs_read_count(inode, 1 << 20, 4096), (size_t)0);
+
+  /* nothing is written at or past s_maxbytes, writes up to it are cut */
+  pos = maxbytes;
+  KUNIT_EXPECT_EQ(test, nullfs_grow_size(inode, &pos, 1, false, &prev),
+                  (ssize_t)-EFBIG);
+  KUNIT_EXPECT_EQ(test, i_size_read(inode), (loff_t)8300);
+
+  pos = maxbytes - 100;
+  KUNIT_EXPECT_EQ(test, nullfs_grow_size(inode, &pos, 4096, false, &prev),
+                  (ssize_t)100);
+  KUNIT_EXPECT_EQ(test, pos, maxbytes);
+  KUNIT_EXPECT_EQ(test, i_size_read(inode), maxbytes);
+  KUNIT_EXPECT_EQ(test, nullfs_read_count(inode, maxbytes - 10, 4096),
+                  (size_t)10);
+  KUNIT_EXPECT_EQ(test, nullfs_read_count(inode, maxbytes, 4096), (size_t)0);
+
+  pos = 0;
+  KUNIT_EXPECT_EQ(test, nullfs_grow_size(inode, &pos, 1, true, &prev),
+                  (ssize_t)-EFBIG);
+}
+
+static void nullfs_test_file_io(struct kunit *test) {
+  struct nullfs_test_ctx *ctx = test->priv;
+  struct file *file = nullfs_test_open(test, "kunit-io", 0);
+  struct inode *inode = file_inode(file);
+  loff_t maxbytes = inode->i_sb->s_maxbytes;
+  struct kstat stat;
+  loff_t pos = 0;
+
+  /* the same checks as above, through write_null and read_null */
+  KUNIT_EXPECT_EQ(test, nullfs_test_pwrite(ctx, 4096, &pos), (ssize_t)4096);
+  KUNIT_EXPECT_EQ(test, pos, (loff_t)4096);
+  KUNIT_EXPECT_EQ(test, i_size_read(inode), (loff_t)4096);
+
+  pos = 1024;
+  KUNIT_EXPECT_EQ(test, nullfs_test_pwrite(ctx, 1024, &pos), (ssize_t)1024);
+  KUNIT_EXPECT_EQ(test, pos, (loff_t)2048);
+  KUNIT_EXPECT_EQ(test, i_size_read(inode), (loff_t)4096);
+
+  pos = 8192;
+  KUNIT_EXPECT_EQ(test, nullfs_test_pwrite(ctx, 100, &pos), (ssize_t)100);
+  KUNIT_EXPECT_EQ(test, i_size_read(inode), (loff_t)8292);
+
+  pos = 0;
+  KUNIT_EXPECT_EQ(test, nullfs_test_pread(ctx, 4096, &pos), (ssize_t)4096);
+  KUNIT_EXPECT_EQ(test, pos, (loff_t)4096);
+  pos = 8000;
+  KUNIT_EXPECT_EQ(test, nullfs_test_pread(ctx, 4096, &pos), (ssize_t)292);
+  KUNIT_EXPECT_EQ(test, pos, (loff_t)8292);
+  KUNIT_EXPECT_EQ(test, nullfs_test_pread(ctx, 4096, &pos), (ssize_t)0);
+  KUNIT_EXPECT_EQ(test, pos, (loff_t)8292);
+  pos = 1 << 20;
+  KUNIT_EXPECT_EQ(test, nullfs_test_pread(ctx, 4096, &pos), (ssize_t)0);
+  KUNIT_EXPECT_EQ(test, pos, (loff_t)(1 << 20));
+
+  KUNIT_ASSERT_EQ(test, nullfs_test_stat(file, &stat), 0);
+  KUNIT_EXPECT_EQ(test, stat.size, (loff_t)8292);
+  KUNIT_EXPECT_EQ(test, stat.blocks,
+                  (u64)DIV_ROUND_UP(8292, PAGE_SIZE) << (PAGE_SHIFT - 9));
+
+  pos = maxbytes;
+  KUNIT_EXPECT_EQ(test, nullfs_test_pwrite(ctx, 1, &pos), (ssize_t)-EFBIG);
+  KUNIT_EXPECT_EQ(test, i_size_read(inode), (loff_t)8292);
+  pos = maxbytes - 100;
+  KUNIT_EXPECT_EQ(test, nullfs_test_pwrite(ctx, 4096, &pos), (ssize_t)100);
+  KUNIT_EXPECT_EQ(test, pos, maxbytes);
+  KUNIT_EXPECT_EQ(test, i_size_read(inode), maxbytes);
+  pos = maxbytes - 10;
+  KUNIT_EXPECT_EQ(test, nullfs_test_pread(ctx, 4096, &pos), (ssize_t)10);
+  KUNIT_EXPECT_EQ(test, nullfs_test_pread(ctx, 4096, &pos), (ssize_t)0);
+}
+
+static void nullfs_test_append_io(struct kunit *test) {
+  struct nullfs_test_ctx *ctx = test->priv;
+  struct file *file = nullfs_test_open(test, "kunit-append", O_APPEND);
+  loff_t pos = 0;
+
+  /* O_APPEND writes go to EOF, wherever the file position is */
+  KUNIT_EXPECT_EQ(test, nullfs_test_pwrite(ctx, 10, &pos), (ssize_t)10);
+  pos = 0;
+  KUNIT_EXPECT_EQ(test, nullfs_test_pwrite(ctx, 10, &pos), (ssize_t)10);
+  KUNIT_EXPECT_EQ(test, pos, (loff_t)20);
+  KUNIT_EXPECT_EQ(test, i_size_read(file_inode(file)), (loff_t)20);
+}
+
+static bool nullfs_test_get_inode_fn(struct nullfs_test_worker *w,
+                                     unsigned int i) {
+  struct nullfs_test_ctx *ctx = w->ctx;
+  struct inode *inode;
+
+  inode = nullfs_get_inode(ctx->sb, NULL, S_IFREG | 0644, 0, NULL);
+  if (!inode)
+    return false;
+  iput(inode);
+  return true;
+}
+
+static void nullfs_test_get_inode(struct kunit *test) {
+  struct nullfs_test_ctx *ctx = test->priv;
+  unsigned int i;
+
+  ctx->fn = nullfs_test_get_inode_fn;
+  for (i = 0; i < ARRAY_SIZE(nullfs_threads); i++)
+    nullfs_test_run(test, "get_inode", nullfs_threads[i]);
+}
+
+static bool nullfs_test_mknod_fn(struct nullfs_test_worker *w, unsigned int i) {
+  struct dentry *dentry;
+  char name[32];
+
+  snprintf(name, sizeof(name), "kunit-%u-%u", w->idx, i);
+  dentry = nullfs_test_create(w->ctx, name, S_IFREG | 0644);
+  w->dentries[i] = dentry;
+  return !IS_ERR(dentry);
+}
+
+static void nullfs_test_mknod(struct kunit *test) {
+  struct nullfs_test_ctx *ctx = test->priv;
+  unsigned int i;
+
+  /* all threads create in the root directory, under its inode lock */
+  ctx->fn = nullfs_test_mknod_fn;
+  ctx->unlink = true;
+  for (i = 0; i < ARRAY_SIZE(nullfs_threads); i++)
+    nullfs_test_run(test, "mknod", nullfs_threads[i]);
+}
+
+static bool nullfs_test_write_fn(struct nullfs_test_worker *w, unsigned int i) {
+  loff_t pos = ((loff_t)w->idx * iters + i) * PAGE_SIZE;
+
+  return nullfs_test_pwrite(w->ctx, PAGE_SIZE, &pos) ==
+             (ssize_t)PAGE_SIZE &&
+         pos == ((loff_t)w->idx * iters + i + 1) * PAGE_SIZE;
+}
+
+static void nullfs_test_write(struct kunit *test) {
+  struct nullfs_test_ctx *ctx = test->priv;
+  struct file *file = nullfs_test_open(test, "kunit-write", 0);
+  unsigned int i;
+
+  /* every thread writes its own range of the file */
+  ctx->fn = nullfs_test_write_fn;
+  for (i = 0; i < ARRAY_SIZE(nullfs_threads); i++) {
+    nullfs_test_run(test, "write", nullfs_threads[i]);
+    KUNIT_EXPECT_EQ(test, i_size_read(file_inode(file)),
+                    (loff_t)nullfs_threads[i] * iters * PAGE_SIZE);
+  }
+}
+
+static bool nullfs_test_read_fn(struct nullfs_test_worker *w, unsigned int i) {
+  loff_t pos = (loff_t)i * PAGE_SIZE;
+
+  return nullfs_test_pread(w->ctx, PAGE_SIZE, &pos) ==
+             (ssize_t)PAGE_SIZE &&
+         pos == (loff_t)(i + 1) * PAGE_SIZE;
+}
+
+static void nullfs_test_read(struct kunit *test) {
+  struct nullfs_test_ctx *ctx = test->priv;
+  struct file *file = nullfs_test_open(test, "kunit-read", 0);
+  loff_t pos = (loff_t)iters * PAGE_SIZE - 1;
+  unsigned int i;
+
+  KUNIT_ASSERT_EQ(test, nullfs_test_pwrite(ctx, 1, &pos), (ssize_t)1);
+  KUNIT_ASSERT_EQ(test, i_size_read(file_inode(file)), pos);
+
+  ctx->fn = nullfs_test_read_fn;
+  for (i = 0; i < ARRAY_SIZE(nullfs_threads); i++)
+    nullfs_test_run(test, "read", nullfs_threads[i]);
+}
+
+static bool nullfs_test_getattr_fn(struct nullfs_test_worker *w,
+                                   unsigned int i) {
+  struct kstat stat;
+
+  return !nullfs_test_stat(w->ctx->file, &stat) &&
+         stat.size == (loff_t)PAGE_SIZE;
+}
+
+static void nullfs_test_getattr(struct kunit *test) {
+  struct nullfs_test_ctx *ctx = test->priv;
+  loff_t pos = 0;
+  unsigned int i;
+
+  nullfs_test_open(test, "kunit-getattr", 0);
+  KUNIT_ASSERT_EQ(test, nullfs_test_pwrite(ctx, PAGE_SIZE, &pos),
+                  (ssize_t)PAGE_SIZE);
+
+  ctx->fn = nullfs_test_getattr_fn;
+  for (i = 0; i < ARRAY_SIZE(nullfs_threads); i++)
+    nullfs_test_run(test, "getattr", nullfs_threads[i]);
+}
+
+static const struct {
+  const char *name;
+  bool keep;
+} nullfs_keep_names[] = {
+    {"fstab", true},     {"etc-fstab.bak", true}, {"nginx.conf", true},
+    {"nginx.conf.old", false}, {"log.1", true},   {"catalog", false},
+    {"data1.bin", true}, {"data12.bin", false},   {"README", false},
+};
+
+static bool nullfs_test_keep_match_fn(struct nullfs_test_worker *w,
+                                      unsigned int i) {
+  unsigned int n;
+
+  for (n = 0; n < ARRAY_SIZE(nullfs_keep_names); n++) {
+    struct qstr name = QSTR_INIT(nullfs_keep_names[n].name,
+                                 strlen(nullfs_keep_names[n].name));
+
+    if (nullfs_patterns_match(w->ctx->keep, &name) !=
+        nullfs_keep_names[n].keep)
+      return false;
+  }
+  return true;
+}
+
+static void nullfs_test_keep_match(struct kunit *test) {
+  struct nullfs_test_ctx *ctx = test->priv;
+  unsigned int i;
+
+  /* same patterns as a write= mount option or the exclude sysfs file */
+  ctx->keep = nullfs_patterns_compile("fstab\n*.conf\nlog*\ndata?.bin\n");
+  KUNIT_ASSERT_FALSE(test, IS_ERR_OR_NULL(ctx->keep));
+
+  ctx->fn = nullfs_test_keep_match_fn;
+  for (i = 0; i < ARRAY_SIZE(nullfs_threads); i++)
+    nullfs_test_run(test, "keep_match", nullfs_threads[i]);
+}
+
+static bool nullfs_test_append_fn(struct nullfs_test_worker *w,
+                                  unsigned int i) {
+  loff_t pos = 0, prev;
+
+  return nullfs_grow_size(w->ctx->inode, &pos, 512, true, &prev) == 512 &&
+         pos > prev;
+}
+
+static void nullfs_test_append(struct kunit *test) {
+  struct nullfs_test_ctx *ctx = test->priv;
+  struct inode *inode = nullfs_test_inode(test);
+  loff_t expect = 0;
+  unsigned int i;
+
+  /* concurrent appends must neither lose nor overlap any growth */
+  ctx->fn = nullfs_test_append_fn;
+  for (i = 0; i < ARRAY_SIZE(nullfs_threads); i++) {
+    nullfs_test_run(test, "append", nullfs_threads[i]);
+    expect += (loff_t)nullfs_threads[i] * iters * 512;
+    KUNIT_EXPECT_EQ(test, i_size_read(inode), expect);
+  }
+}
+
+static int nullfs_test_init(struct kunit *test) {
+  struct nullfs_test_ctx *ctx;
+  struct file_system_type *type;
+
+  ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+  if (!ctx)
+    return -ENOMEM;
+  ctx->buf = kunit_kzalloc(test, PAGE_SIZE, GFP_KERNEL);
+  if (!ctx->buf)
+    return -ENOMEM;
+
+  type = get_fs_type("nullfsvfs");
+  if (!type)
+    return -ENODEV;
+  ctx->mnt = kern_mount(type);
+  /* the mount holds its own module reference */
+  module_put(type->owner);
+  if (IS_ERR(ctx->mnt))
+    return PTR_ERR(ctx->mnt);
+  ctx->sb = ctx->mnt->mnt_sb;
+  test->priv = ctx;
+  return 0;
+}
+
+static void nullfs_test_exit(struct kunit *test) {
+  struct nullfs_test_ctx *ctx = test->priv;
+
+  if (ctx->file) {
+    fput(ctx->file);
+    /* kernel threads close files from a work item */
+    flush_delayed_fput();
+  }
+  if (ctx->dentry)
+    nullfs_test_unlink(ctx->dentry);
+  iput(ctx->inode);
+  nullfs_patterns_free(ctx->keep);
+  kern_unmount(ctx->mnt);
+}
+
+static struct kunit_case nullfs_test_cases[] = {
+    KUNIT_CASE(nullfs_test_size),
+    KUNIT_CASE(nullfs_test_file_io),
+    KUNIT_CASE(nullfs_test_append_io),
+    KUNIT_CASE(nullfs_test_get_inode),
+    KUNIT_CASE(nullfs_test_mknod),
+    KUNIT_CASE(nullfs_test_write),
+    KUNIT_CASE(nullfs_test_read),
+    KUNIT_CASE(nullfs_test_getattr),
+    KUNIT_CASE(nullfs_test_keep_match),
+    KUNIT_CASE(nullfs_test_append),
+    {}};
+
+static struct kunit_suite nullfs_test_suite = {
+    .name = "nullfsvfs",
+    .init = nullfs_test_init,
+    .exit = nullfs_test_exit,
+    .test_cases = nullfs_test_cases,
+};
+
+kunit_test_suite(nullfs_test_suite);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+MODULE_IMPORT_NS("EXPORTED_FOR_KUNIT_TESTING");
+#else
+MODULE_IMPORT_NS(EXPORTED_FOR_KUNIT_TESTING);
+#endif
+#endif
+
+MODULE_AUTHOR("Michael Ablassmeier");
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("KUnit tests for nullfsvfs");
@@ -0,0 +1,214 @@
+/*
+ *   nullfsvfs tracepoints
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ *
+ *
+ * Events show up below /sys/kernel/tracing/events/nullfsvfs/ and can be
+ * used with perf, trace-cmd or bpftrace. Disabled tracepoints cost a
+ * patched out branch.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM nullfsvfs
+
+#if !defined(_NULLFSVFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _NULLFSVFS_TRACE_H
+
+#include <linux/fs.h>
+#include <linux/tracepoint.h>
+#include <linux/version.h>
+
+/**
+ * __assign_str() lost its source argument in 6.10
+ **/
+#ifndef nullfs_assign_str
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#define nullfs_assign_str(dst, src) __assign_str(dst)
+#else
+#define nullfs_assign_str(dst, src) __assign_str(dst, src)
+#endif
+#endif
+
+DECLARE_EVENT_CLASS(
+    nullfs_dir_class,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, umode_t mode, int ret),
+    TP_ARGS(dir, dentry, mode, ret),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(u64, dir)
+        __field(u64, ino)
+        __field(loff_t, size)
+        __field(umode_t, mode)
+        __field(int, ret)
+        __string(name, dentry->d_name.name)
+    ),
+    TP_fast_assign(
+        struct inode *inode = d_inode(dentry);
+
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->ino = inode ? inode->i_ino : 0;
+        __entry->size = inode ? i_size_read(inode) : 0;
+        __entry->mode = mode;
+        __entry->ret = ret;
+        nullfs_assign_str(name, dentry->d_name.name);
+    ),
+    TP_printk("dev %d:%d dir %llu name %s ino %llu size %lld mode 0%o ret %d",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+              __get_str(name), __entry->ino, __entry->size, __entry->mode,
+              __entry->ret)
+);
+
+#define NULLFS_DIR_EVENT(_name)                                                \
+  DEFINE_EVENT(nullfs_dir_class, _name,                                        \
+               TP_PROTO(struct inode *dir, struct dentry *dentry,              \
+                        umode_t mode, int ret),                                \
+               TP_ARGS(dir, dentry, mode, ret))
+
+NULLFS_DIR_EVENT(nullfs_create);
+NULLFS_DIR_EVENT(nullfs_mknod);
+NULLFS_DIR_EVENT(nullfs_mkdir);
+NULLFS_DIR_EVENT(nullfs_unlink);
+NULLFS_DIR_EVENT(nullfs_lookup);
+
+TRACE_EVENT(
+    nullfs_rename,
+    TP_PROTO(struct inode *old_dir, struct dentry *old_dentry,
+             struct inode *new_dir, struct dentry *new_dentry,
+             unsigned int flags, int ret),
+    TP_ARGS(old_dir, old_dentry, new_dir, new_dentry, flags, ret),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(u64, old_dir)
+        __field(u64, new_dir)
+        __field(u64, ino)
+        __field(loff_t, size)
+        __field(unsigned int, flags)
+        __field(int, ret)
+        __string(old_name, old_dentry->d_name.name)
+        __string(new_name, new_dentry->d_name.name)
+    ),
+    TP_fast_assign(
+        struct inode *inode = d_inode(old_dentry);
+
+        __entry->dev = old_dir->i_sb->s_dev;
+        __entry->old_dir = old_dir->i_ino;
+        __entry->new_dir = new_dir->i_ino;
+        __entry->ino = inode ? inode->i_ino : 0;
+        __entry->size = inode ? i_size_read(inode) : 0;
+        __entry->flags = flags;
+        __entry->ret = ret;
+        nullfs_assign_str(old_name, old_dentry->d_name.name);
+        nullfs_assign_str(new_name, new_dentry->d_name.name);
+    ),
+    TP_printk("dev %d:%d ino %llu size %lld %llu/%s -> %llu/%s flags 0x%x "
+              "ret %d",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+              __entry->size, __entry->old_dir, __get_str(old_name),
+              __entry->new_dir, __get_str(new_name), __entry->flags,
+              __entry->ret)
+);
+
+DECLARE_EVENT_CLASS(
+    nullfs_io_class,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t len, ssize_t ret,
+             bool kept),
+    TP_ARGS(inode, pos, len, ret, kept),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(u64, ino)
+        __field(loff_t, size)
+        __field(loff_t, pos)
+        __field(size_t, len)
+        __field(ssize_t, ret)
+        __field(bool, kept)
+    ),
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->size = i_size_read(inode);
+        __entry->pos = pos;
+        __entry->len = len;
+        __entry->ret = ret;
+        __entry->kept = kept;
+    ),
+    TP_printk("dev %d:%d ino %llu size %lld pos %lld len %zu ret %zd %s",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+              __entry->size, __entry->pos, __entry->len, __entry->ret,
+              __entry->kept ? "kept" : "nulled")
+);
+
+#define NULLFS_IO_EVENT(_name)                                                 \
+  DEFINE_EVENT(nullfs_io_class, _name,                                         \
+               TP_PROTO(struct inode *inode, loff_t pos, size_t len,           \
+                        ssize_t ret, bool kept),                               \
+               TP_ARGS(inode, pos, len, ret, kept))
+
+NULLFS_IO_EVENT(nullfs_write);
+NULLFS_IO_EVENT(nullfs_read);
+
+TRACE_EVENT(
+    nullfs_fsync,
+    TP_PROTO(struct inode *inode, loff_t start, loff_t end, int datasync),
+    TP_ARGS(inode, start, end, datasync),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(u64, ino)
+        __field(loff_t, size)
+        __field(loff_t, start)
+        __field(loff_t, end)
+        __field(int, datasync)
+    ),
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->size = i_size_read(inode);
+        __entry->start = start;
+        __entry->end = end;
+        __entry->datasync = datasync;
+    ),
+    TP_printk("dev %d:%d ino %llu size %lld range %lld-%lld datasync %d",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+              __entry->size, __entry->start, __entry->end, __entry->datasync)
+);
+
+TRACE_EVENT(
+    nullfs_keep_data,
+    TP_PROTO(struct inode *inode, struct dentry *dentry, bool keep),
+    TP_ARGS(inode, dentry, keep),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(u64, ino)
+        __field(bool, keep)
+        __string(name, dentry->d_name.name)
+    ),
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->keep = keep;
+        nullfs_assign_str(name, dentry->d_name.name);
+    ),
+    TP_printk("dev %d:%d ino %llu name %s %s", MAJOR(__entry->dev),
+              MINOR(__entry->dev), __entry->ino, __get_str(name),
+              __entry->keep ? "kept" : "nulled")
+);
+
+#endif /* _NULLFSVFS_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE nullfsvfs_trace
+#include <trace/define_trace.h>